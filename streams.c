@@ -1,4 +1,7 @@
+#define _GNU_SOURCE
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,27 +14,274 @@
 #include <netinet/in.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
-#include <sys/select.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <linux/sockios.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+#include <sys/un.h>
 #include <unistd.h>
 
 #include <arpa/inet.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #include "streams.h"
 
+/* Futex word bumped on every notification, with a count of sleepers so
+ * the wake can usually be skipped */
+struct stream_waitq {
+    _Atomic uint32_t seq;
+    _Atomic uint32_t waiters;
+};
+
 struct stream {
     int (*read)(struct stream *stream, void *result, const int max_size);
     int (*write)(struct stream *stream, const void *const data,
                  const int data_len);
     int (*available)(struct stream *stream, int *read, int *write);
+    int (*available64)(struct stream *stream, int64_t *read, int64_t *write);
     int (*close)(struct stream *stream);
+    int (*peek)(struct stream *stream, const void **ptr, int *len);
+    int (*consume)(struct stream *stream, int len);
+    int (*readv)(struct stream *stream, const struct iovec *iov, int iovcnt);
+    int (*writev)(struct stream *stream, const struct iovec *iov,
+                  int iovcnt);
+    /* Returns the underlying descriptor, ready for direct use */
+    int (*get_fd)(struct stream *stream);
+    int (*flush)(struct stream *stream);
+    int (*set_nonblocking)(struct stream *stream, bool enable);
+    /* Operations return -EAGAIN rather than waiting */
+    bool nonblocking;
 
     void (*notify)(void *data, struct stream *stream);
     void *notify_data;
+    /* Edge triggered callbacks, along with the readiness last reported */
+    void (*notify_read)(void *data, struct stream *stream);
+    void (*notify_write)(void *data, struct stream *stream);
+    void *notify_ex_data;
+    _Atomic bool readable;
+    _Atomic bool writable;
+    /* Minimum counts from stream_available before a direction is ready */
+    int read_lowat;
+    int write_lowat;
+    /* Bumped on every notification, for stream_wait to sleep on */
+    struct stream_waitq wait;
+    /* Used instead by streams whose other end is in another process, so
+     * lives in memory shared with it */
+    struct stream_waitq *shared_wait;
+    /* Set while a stream_poll is watching this stream */
+    _Atomic bool polled;
+    /* eventfd signalled by notifications while polled, plus one (0 if
+     * none). Created by the first stream_poll and kept until close, so a
+     * notification never writes to a descriptor the stream doesn't own */
+    _Atomic int wake_fd;
+    /* Stream this one is layered on, so waits can reach its descriptor */
+    struct stream *parent;
+    /* When set, readiness is reported from stream_loop_run instead of
+     * being checked after every operation */
+    struct stream_loop *loop;
+    /* Neighbours in the loop's list of members */
+    struct stream *loop_prev;
+    struct stream *loop_next;
+
+    /* Read-ahead used by stream_peek for streams without native support */
+    uint8_t *peek_buf;
+    int peek_pos;
+    int peek_len;
+
+    /* Storage was supplied by the caller, so isn't freed on close */
+    bool external;
+
+    /* Only allocated once stream_enable_stats is called */
+    struct stream_stats *stats;
 };
 
+#define STREAM_PEEK_SIZE 4096
+
+static void *(*stream_alloc_fn)(size_t size) = malloc;
+static void (*stream_free_fn)(void *ptr) = free;
+
+void stream_set_allocator(void *(*alloc)(size_t size),
+                          void (*release)(void *ptr))
+{
+    stream_alloc_fn = alloc ? alloc : malloc;
+    stream_free_fn = release ? release : free;
+}
+
+/* All stream memory comes from here, zeroed */
+static void *stream_alloc(size_t size)
+{
+    void *ptr = stream_alloc_fn(size);
+    if (ptr)
+        memset(ptr, 0, size);
+    return ptr;
+}
+
+static void stream_free(void *ptr)
+{
+    if (ptr)
+        stream_free_fn(ptr);
+}
+
+static uint64_t stream_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int stream_enable_stats(struct stream *stream, bool enable)
+{
+    if (!stream)
+        return -EINVAL;
+    if (!enable) {
+        stream_free(stream->stats);
+        stream->stats = NULL;
+    } else if (!stream->stats) {
+        stream->stats = stream_alloc(sizeof(struct stream_stats));
+        if (!stream->stats)
+            return -ENOMEM;
+    }
+    return 0;
+}
+
+/* Several threads may read, write or notify at once (ie: the writers of
+ * a shared pipe), so every counter is moved on with an atomic add */
+static inline void stats_add(uint64_t *counter, uint64_t n)
+{
+    atomic_fetch_add_explicit((_Atomic uint64_t *)counter, n,
+                              memory_order_relaxed);
+}
+
+static inline void stats_notified(struct stream *stream)
+{
+    if (stream->stats)
+        stats_add(&stream->stats->notifies, 1);
+}
+
+int stream_get_stats(struct stream *stream, struct stream_stats *stats)
+{
+    if (!stream || !stats)
+        return -EINVAL;
+    if (!stream->stats)
+        return -ENODATA;
+    _Atomic uint64_t *src = (_Atomic uint64_t *)stream->stats;
+    uint64_t *dst = (uint64_t *)stats;
+    for (size_t i = 0; i < sizeof(*stats) / sizeof(uint64_t); i++)
+        dst[i] = atomic_load_explicit(&src[i], memory_order_relaxed);
+    return 0;
+}
+
+int stream_reset_stats(struct stream *stream)
+{
+    if (!stream)
+        return -EINVAL;
+    if (!stream->stats)
+        return -ENODATA;
+    _Atomic uint64_t *counters = (_Atomic uint64_t *)stream->stats;
+    for (size_t i = 0; i < sizeof(*stream->stats) / sizeof(uint64_t); i++)
+        atomic_store_explicit(&counters[i], 0, memory_order_relaxed);
+    return 0;
+}
+
+static int stats_bucket(uint64_t start)
+{
+    uint64_t elapsed = stream_now_ns() - start;
+    int bucket = elapsed ? 63 - __builtin_clzll(elapsed) : 0;
+
+    return bucket < STREAM_STATS_BUCKETS ? bucket : STREAM_STATS_BUCKETS - 1;
+}
+
+/* Account for one read or write call, which began at 'start' */
+static void stats_record(struct stream *stream, bool reading,
+                         size_t requested, ssize_t result, uint64_t start)
+{
+    struct stream_stats *stats = stream->stats;
+    int bucket = stats_bucket(start);
+
+    if (reading) {
+        stats_add(&stats->reads, 1);
+        stats_add(&stats->read_latency[bucket], 1);
+        if (result < 0)
+            stats_add(&stats->read_errors, 1);
+        else
+            stats_add(&stats->read_bytes, result);
+        if (result >= 0 && (size_t)result < requested)
+            stats_add(&stats->short_reads, 1);
+    } else {
+        stats_add(&stats->writes, 1);
+        stats_add(&stats->write_latency[bucket], 1);
+        if (result < 0)
+            stats_add(&stats->write_errors, 1);
+        else
+            stats_add(&stats->write_bytes, result);
+        if (result >= 0 && (size_t)result < requested)
+            stats_add(&stats->short_writes, 1);
+    }
+}
+
+/* Peeks are timed along with the reads, but their data is only counted
+ * once it is consumed */
+static void stats_record_peek(struct stream *stream, int result,
+                              uint64_t start)
+{
+    struct stream_stats *stats = stream->stats;
+
+    stats_add(&stats->peeks, 1);
+    stats_add(&stats->read_latency[stats_bucket(start)], 1);
+    if (result < 0)
+        stats_add(&stats->read_errors, 1);
+}
+
+static size_t iov_total(const struct iovec *iov, int iovcnt)
+{
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++)
+        total += iov[i].iov_len;
+    return total;
+}
+
+/* Prepare caller supplied storage to hold a stream which needs 'needed'
+ * bytes in total */
+static struct stream *stream_from_storage(void *storage, size_t storage_len,
+                                          size_t needed)
+{
+    if (!storage || storage_len < needed ||
+        (uintptr_t)storage % _Alignof(max_align_t))
+        return NULL;
+    memset(storage, 0, needed);
+    struct stream *stream = storage;
+    stream->external = true;
+    return stream;
+}
+
+/* Hand storage from stream_alloc over to the stream built in it by one of
+ * the stream_*_init functions */
+static struct stream *stream_adopt(struct stream *stream, void *storage)
+{
+    if (!stream) {
+        stream_free(storage);
+        return NULL;
+    }
+    stream->external = false;
+    return stream;
+}
+
 int stream_set_notify(struct stream *stream,
                       void (*notify)(void *data, struct stream *stream),
                       void *data)
@@ -41,17 +291,153 @@ int stream_set_notify(struct stream *stream,
     return 0;
 }
 
-static inline void stream_notify(struct stream *stream)
+int stream_set_notify_ex(struct stream *stream,
+                         void (*on_read)(void *data, struct stream *stream),
+                         void (*on_write)(void *data, struct stream *stream),
+                         void *data)
+{
+    if (!stream)
+        return -EINVAL;
+    stream->notify_read = on_read;
+    stream->notify_write = on_write;
+    stream->notify_ex_data = data;
+    /* Start from not ready, so the next check reports the current state */
+    atomic_store(&stream->readable, false);
+    atomic_store(&stream->writable, false);
+    return 0;
+}
+
+int stream_set_lowat(struct stream *stream, int read_lowat, int write_lowat)
+{
+    if (!stream || read_lowat < 0 || write_lowat < 0)
+        return -EINVAL;
+    stream->read_lowat = read_lowat;
+    stream->write_lowat = write_lowat;
+    /* Let the kernel hold back POLLIN on a socket until the watermark is
+     * reached, so stream_wait/stream_poll don't wake for every byte. This
+     * fails harmlessly on anything else, which (like the write side, as
+     * Linux has no settable SO_SNDLOWAT) relies on the waits backing off */
+    if (stream->get_fd && !stream_uses_uring(stream)) {
+        int fd = stream->get_fd(stream);
+        int lowat = read_lowat > 0 ? read_lowat : 1;
+        if (fd >= 0)
+            setsockopt(fd, SOL_SOCKET, SO_RCVLOWAT, &lowat, sizeof(lowat));
+    }
+    return 0;
+}
+
+/* Work out which directions are ready, taking the watermarks into
+ * account. A finished stream is readable, so the reader gets to see the
+ * end. Either pointer may be NULL, to skip counting that direction */
+static int stream_ready(struct stream *stream, bool *readable,
+                        bool *writable)
+{
+    int read = 0, write = 0;
+    int e = stream_available(stream, readable ? &read : NULL,
+                             writable ? &write : NULL);
+    if (e < 0)
+        return e;
+    if (readable)
+        *readable = (read > 0 && read >= stream->read_lowat) ||
+                    (e == 0 && stream->read);
+    if (writable)
+        *writable = write > 0 && write >= stream->write_lowat;
+    return e;
+}
+
+/* The level callback fires every time one of the 'changed' directions
+ * (STREAM_* events) does, unless that direction has a watermark, in which
+ * case only once the watermark is reached. So a read watermark leaves
+ * wakeups for write space alone, as SO_RCVLOWAT does POLLOUT */
+static void stream_notify_level(struct stream *stream, int changed)
+{
+    bool readable = false, writable = false;
+
+    if (!stream->notify)
+        return;
+    bool check_read = (changed & STREAM_READABLE) && stream->read_lowat;
+    bool check_write = (changed & STREAM_WRITABLE) && stream->write_lowat;
+    bool fire = ((changed & STREAM_READABLE) && !stream->read_lowat) ||
+                ((changed & STREAM_WRITABLE) && !stream->write_lowat);
+    if (!fire && (check_read || check_write)) {
+        if (stream_ready(stream, check_read ? &readable : NULL,
+                         check_write ? &writable : NULL) < 0)
+            return;
+        fire = readable || writable;
+    }
+    if (!fire)
+        return;
+    stats_notified(stream);
+    stream->notify(stream->notify_data, stream);
+}
+
+static void stream_notify_read(struct stream *stream)
+{
+    if (!stream->notify_read)
+        return;
+    stats_notified(stream);
+    stream->notify_read(stream->notify_ex_data, stream);
+}
+
+static void stream_notify_write(struct stream *stream)
+{
+    if (!stream->notify_write)
+        return;
+    stats_notified(stream);
+    stream->notify_write(stream->notify_ex_data, stream);
+}
+
+/* Fire the edge triggered callbacks for any direction which has become
+ * ready since the last check. Only the 'changed' directions (STREAM_*
+ * events) are counted again. Both ends of a lock-free pipe get here, so
+ * the last state is swapped atomically and each edge is reported once */
+static void stream_notify_edges(struct stream *stream, int changed)
+{
+    bool readable, writable;
+    bool check_read = (changed & STREAM_READABLE) && stream->notify_read;
+    bool check_write = (changed & STREAM_WRITABLE) && stream->notify_write;
+
+    if (!check_read && !check_write)
+        return;
+    if (stream_ready(stream, check_read ? &readable : NULL,
+                     check_write ? &writable : NULL) < 0)
+        return;
+    if (check_read && !readable)
+        atomic_store(&stream->readable, false);
+    else if (check_read && !atomic_exchange(&stream->readable, true))
+        stream_notify_read(stream);
+    if (check_write && !writable)
+        atomic_store(&stream->writable, false);
+    else if (check_write && !atomic_exchange(&stream->writable, true))
+        stream_notify_write(stream);
+}
+
+static void stream_wake(struct stream *stream);
+
+/* Tell anyone watching that an operation has changed the 'changed'
+ * directions (STREAM_* events) */
+static inline void stream_notify(struct stream *stream, int changed)
+{
+    stream_notify_level(stream, changed);
+    stream_notify_edges(stream, changed);
+    stream_wake(stream);
+}
+
+/* For pipes, where one stream is both ends: each operation moves bytes
+ * between the two directions, so both edges are checked, but only the
+ * direction which 'gained' can have become ready for the level callback */
+static inline void stream_notify_moved(struct stream *stream, int gained)
 {
-    if (stream->notify)
-        stream->notify(stream->notify_data, stream);
+    stream_notify_level(stream, gained);
+    stream_notify_edges(stream, STREAM_READABLE | STREAM_WRITABLE);
+    stream_wake(stream);
 }
 
 static void stream_chain_notify(void *data, struct stream *parent)
 {
     (void)parent;
     struct stream *child = data;
-    stream_notify(child);
+    stream_notify(child, STREAM_READABLE | STREAM_WRITABLE);
 }
 
 int stream_read(struct stream *stream, void *result, const int max_size)
@@ -60,7 +446,24 @@ int stream_read(struct stream *stream, void *result, const int max_size)
         return -EINVAL;
     if (!stream->read)
         return -ENOTSUP;
-    return stream->read(stream, result, max_size);
+    if (stream->peek_pos < stream->peek_len) {
+        /* Hand back anything a fallback stream_peek has already read */
+        uint64_t start = stream->stats ? stream_now_ns() : 0;
+        int len = stream->peek_len - stream->peek_pos;
+        if (len > max_size)
+            len = max_size;
+        memcpy(result, &stream->peek_buf[stream->peek_pos], len);
+        stream->peek_pos += len;
+        if (stream->stats)
+            stats_record(stream, true, max_size, len, start);
+        return len;
+    }
+    if (!stream->stats)
+        return stream->read(stream, result, max_size);
+    uint64_t start = stream_now_ns();
+    int e = stream->read(stream, result, max_size);
+    stats_record(stream, true, max_size, e, start);
+    return e;
 }
 
 int stream_write(struct stream *stream, const void *const data,
@@ -70,7 +473,96 @@ int stream_write(struct stream *stream, const void *const data,
         return -EINVAL;
     if (!stream->write)
         return -ENOTSUP;
-    return stream->write(stream, data, data_len);
+    if (!stream->stats)
+        return stream->write(stream, data, data_len);
+    uint64_t start = stream_now_ns();
+    int e = stream->write(stream, data, data_len);
+    stats_record(stream, false, data_len, e, start);
+    return e;
+}
+
+int stream_readv(struct stream *stream, const struct iovec *iov, int iovcnt)
+{
+    ssize_t total = 0;
+    if (!stream || (!iov && iovcnt) || iovcnt < 0)
+        return -EINVAL;
+    if (!stream->read)
+        return -ENOTSUP;
+    if (stream->readv && stream->peek_pos >= stream->peek_len) {
+        if (!stream->stats)
+            return stream->readv(stream, iov, iovcnt);
+        uint64_t start = stream_now_ns();
+        int e = stream->readv(stream, iov, iovcnt);
+        stats_record(stream, true, iov_total(iov, iovcnt), e, start);
+        return e;
+    }
+
+    /* Fill each vector in turn, stopping at the first short read */
+    for (int i = 0; i < iovcnt && total < INT_MAX; i++) {
+        size_t want = iov[i].iov_len;
+        if (want > (size_t)(INT_MAX - total))
+            want = INT_MAX - total;
+        int e = stream_read(stream, iov[i].iov_base, want);
+        if (e < 0)
+            return total ? total : e;
+        total += e;
+        if ((size_t)e < iov[i].iov_len)
+            break;
+    }
+    return total;
+}
+
+int stream_writev(struct stream *stream, const struct iovec *iov,
+                  int iovcnt)
+{
+    ssize_t total = 0;
+    if (!stream || (!iov && iovcnt) || iovcnt < 0)
+        return -EINVAL;
+    if (!stream->write)
+        return -ENOTSUP;
+    if (stream->writev) {
+        if (!stream->stats)
+            return stream->writev(stream, iov, iovcnt);
+        uint64_t start = stream_now_ns();
+        int e = stream->writev(stream, iov, iovcnt);
+        stats_record(stream, false, iov_total(iov, iovcnt), e, start);
+        return e;
+    }
+
+    for (int i = 0; i < iovcnt && total < INT_MAX; i++) {
+        size_t want = iov[i].iov_len;
+        if (want > (size_t)(INT_MAX - total))
+            want = INT_MAX - total;
+        int e = stream_write(stream, iov[i].iov_base, want);
+        if (e < 0)
+            return total ? total : e;
+        total += e;
+        if ((size_t)e < iov[i].iov_len)
+            break;
+    }
+    return total;
+}
+
+int stream_flush(struct stream *stream)
+{
+    if (!stream)
+        return -EINVAL;
+    if (!stream->flush)
+        return 0;
+    return stream->flush(stream);
+}
+
+int stream_set_nonblocking(struct stream *stream, bool enable)
+{
+    if (!stream)
+        return -EINVAL;
+    if (!stream->set_nonblocking)
+        return -EOPNOTSUPP;
+    int e = stream->set_nonblocking(stream, enable);
+    if (e < 0)
+        return e;
+    stream->nonblocking = enable;
+    return 0;
 }
 
 int stream_close(struct stream *stream)
@@ -78,9 +570,16 @@ int stream_close(struct stream *stream)
     int ret = 0;
     if (!stream)
         return -EINVAL;
+    if (stream->loop)
+        stream_loop_remove(stream->loop, stream);
     if (stream->close)
         ret = stream->close(stream);
-    free(stream);
+    stream_free(stream->peek_buf);
+    stream_free(stream->stats);
+    if (stream->wake_fd)
+        close(stream->wake_fd - 1);
+    if (!stream->external)
+        stream_free(stream);
     return ret;
 }
 
@@ -88,6 +587,18 @@ int stream_available(struct stream *stream, int *read, int *write)
 {
     if (!stream)
         return -EINVAL;
+    if (stream->peek_pos < stream->peek_len) {
+        int pending = stream->peek_len - stream->peek_pos;
+        int e = stream->available ? stream->available(stream, read, write)
+                                  : 1;
+        if (e < 0)
+            return e;
+        if (read && *read < pending)
+            *read = pending;
+        if (write && !stream->available)
+            *write = stream->write ? 1 : 0;
+        return 1;
+    }
     if (!stream->available) {
         /* For streams that don't support it, just assume they're always
          * available */
@@ -100,6 +611,149 @@ int stream_available(struct stream *stream, int *read, int *write)
     return stream->available(stream, read, write);
 }
 
+int stream_available64(struct stream *stream, int64_t *read, int64_t *write)
+{
+    int r = 0, w = 0;
+    if (!stream)
+        return -EINVAL;
+    if (stream->available64 && stream->peek_pos >= stream->peek_len)
+        return stream->available64(stream, read, write);
+    int e = stream_available(stream, &r, &w);
+    if (read)
+        *read = r;
+    if (write)
+        *write = w;
+    return e;
+}
+
+/* Readers of 'int' sizes are chunked into pieces of this size */
+#define STREAM_CHUNK_MAX (1 << 30)
+
+ssize_t stream_read64(struct stream *stream, void *result, size_t max_size)
+{
+    uint8_t *r8 = result;
+    size_t total = 0;
+
+    if (max_size > SSIZE_MAX)
+        max_size = SSIZE_MAX;
+    do {
+        size_t len = max_size - total;
+        if (len > STREAM_CHUNK_MAX)
+            len = STREAM_CHUNK_MAX;
+        int e = stream_read(stream, r8 + total, len);
+        if (e < 0)
+            return total ? (ssize_t)total : e;
+        total += e;
+        /* A short read means there isn't any more for now */
+        if ((size_t)e < len)
+            break;
+    } while (total < max_size);
+    return total;
+}
+
+ssize_t stream_write64(struct stream *stream, const void *const data,
+                       size_t data_len)
+{
+    const uint8_t *d8 = data;
+    size_t total = 0;
+
+    if (data_len > SSIZE_MAX)
+        data_len = SSIZE_MAX;
+    do {
+        size_t len = data_len - total;
+        if (len > STREAM_CHUNK_MAX)
+            len = STREAM_CHUNK_MAX;
+        int e = stream_write(stream, d8 + total, len);
+        if (e < 0)
+            return total ? (ssize_t)total : e;
+        total += e;
+        if ((size_t)e < len)
+            break;
+    } while (total < data_len);
+    return total;
+}
+
+static int stream_peek_fill(struct stream *stream, const void **ptr,
+                            int *len)
+{
+    if (stream->peek)
+        return stream->peek(stream, ptr, len);
+
+    if (stream->peek_pos >= stream->peek_len) {
+        if (!stream->peek_buf) {
+            stream->peek_buf = stream_alloc(STREAM_PEEK_SIZE);
+            if (!stream->peek_buf)
+                return -ENOMEM;
+        }
+        int e = stream->read(stream, stream->peek_buf, STREAM_PEEK_SIZE);
+        if (e < 0)
+            return e;
+        stream->peek_pos = 0;
+        stream->peek_len = e;
+    }
+    *ptr = &stream->peek_buf[stream->peek_pos];
+    *len = stream->peek_len - stream->peek_pos;
+    return *len;
+}
+
+int stream_peek(struct stream *stream, const void **ptr, int *len)
+{
+    if (!stream || !ptr || !len)
+        return -EINVAL;
+    if (!stream->read)
+        return -ENOTSUP;
+    if (!stream->stats)
+        return stream_peek_fill(stream, ptr, len);
+    uint64_t start = stream_now_ns();
+    int e = stream_peek_fill(stream, ptr, len);
+    stats_record_peek(stream, e, start);
+    return e;
+}
+
+static int stream_consume_peeked(struct stream *stream, int len)
+{
+    if (stream->consume)
+        return stream->consume(stream, len);
+
+    if (len > stream->peek_len - stream->peek_pos)
+        return -EINVAL;
+    stream->peek_pos += len;
+    return len;
+}
+
+int stream_consume(struct stream *stream, int len)
+{
+    if (!stream || len < 0)
+        return -EINVAL;
+    if (!stream->read)
+        return -ENOTSUP;
+    if (!stream->stats)
+        return stream_consume_peeked(stream, len);
+    uint64_t start = stream_now_ns();
+    int e = stream_consume_peeked(stream, len);
+    stats_record(stream, true, len, e, start);
+    return e;
+}
+
+/* Implement the 'int' available callback in terms of a 64-bit one, capping
+ * the counts */
+static int stream_available_int(struct stream *stream,
+                                int (*available64)(struct stream *stream,
+                                                   int64_t *read,
+                                                   int64_t *write),
+                                int *read, int *write)
+{
+    int64_t r, w;
+    int e = available64(stream, &r, &w);
+    if (e < 0)
+        return e;
+    if (read)
+        *read = r > INT_MAX ? INT_MAX : r;
+    if (write)
+        *write = w > INT_MAX ? INT_MAX : w;
+    return e;
+}
+
 struct mem_stream {
     uint8_t *base;
     size_t len;
@@ -114,10 +768,10 @@ static struct mem_stream *stream_to_mem(struct stream *stream)
 static int mem_read(struct stream *stream, void *result, const int max_size)
 {
     struct mem_stream *mem = stream_to_mem(stream);
-    int size = max_size;
-    int remaining = mem->len - mem->pos;
+    size_t size = max_size;
+    size_t remaining = mem->len - mem->pos;
 
-    if (remaining <= 0)
+    if (remaining == 0 || max_size <= 0)
         return 0;
 
     if (size > remaining)
@@ -127,7 +781,7 @@ static int mem_read(struct stream *stream, void *result, const int max_size)
     mem->pos += size;
 
     if (mem->pos < mem->len)
-        stream_notify(stream);
+        stream_notify(stream, STREAM_READABLE);
 
     return size;
 }
@@ -136,10 +790,10 @@ static int mem_write(struct stream *stream, const void *const data,
                      const int data_len)
 {
     struct mem_stream *mem = stream_to_mem(stream);
-    int size = data_len;
-    int remaining = mem->len - mem->pos;
+    size_t size = data_len;
+    size_t remaining = mem->len - mem->pos;
 
-    if (remaining <= 0)
+    if (remaining == 0 || data_len <= 0)
         return 0;
 
     if (size > remaining)
@@ -149,12 +803,37 @@ static int mem_write(struct stream *stream, const void *const data,
     mem->pos += size;
 
     if (mem->pos < mem->len)
-        stream_notify(stream);
+        stream_notify(stream, STREAM_WRITABLE);
 
     return size;
 }
 
-static int mem_available(struct stream *stream, int *read, int *write)
+static int mem_peek(struct stream *stream, const void **ptr, int *len)
+{
+    struct mem_stream *mem = stream_to_mem(stream);
+    size_t remaining = mem->len - mem->pos;
+
+    *ptr = mem->base + mem->pos;
+    *len = remaining > INT_MAX ? INT_MAX : (int)remaining;
+    return *len;
+}
+
+static int mem_consume(struct stream *stream, int len)
+{
+    struct mem_stream *mem = stream_to_mem(stream);
+
+    if ((size_t)len > mem->len - mem->pos)
+        return -EINVAL;
+    mem->pos += len;
+
+    if (mem->pos < mem->len)
+        stream_notify(stream, STREAM_READABLE);
+
+    return len;
+}
+
+static int mem_available64(struct stream *stream, int64_t *read,
+                           int64_t *write)
 {
     struct mem_stream *mem = stream_to_mem(stream);
     if (read)
@@ -164,11 +843,32 @@ static int mem_available(struct stream *stream, int *read, int *write)
     return (mem->pos == mem->len) ? 0 : 1;
 }
 
+static int mem_available(struct stream *stream, int *read, int *write)
+{
+    return stream_available_int(stream, mem_available64, read, write);
+}
+
+size_t stream_mem_storage_size(void)
+{
+    return sizeof(struct stream) + sizeof(struct mem_stream);
+}
+
 struct stream *stream_mem_open(void *memory_area, size_t memory_len,
                                const char *mode)
 {
-    struct stream *stream =
-        calloc(sizeof(struct stream) + sizeof(struct mem_stream), 1);
+    size_t size = stream_mem_storage_size();
+    void *storage = stream_alloc(size);
+    return stream_adopt(
+        stream_mem_init(storage, size, memory_area, memory_len, mode),
+        storage);
+}
+
+struct stream *stream_mem_init(void *storage, size_t storage_len,
+                               void *memory_area, size_t memory_len,
+                               const char *mode)
+{
+    struct stream *stream = stream_from_storage(storage, storage_len,
+                                                stream_mem_storage_size());
     if (!stream)
         return NULL;
     struct mem_stream *mem = (struct mem_stream *)(stream + 1);
@@ -179,6 +879,9 @@ struct stream *stream_mem_open(void *memory_area, size_t memory_len,
     stream->write = strchr(mode, 'w') ? mem_write : NULL;
     stream->read = strchr(mode, 'r') ? mem_read : NULL;
     stream->available = mem_available;
+    stream->available64 = mem_available64;
+    stream->peek = mem_peek;
+    stream->consume = mem_consume;
 
     return stream;
 }
@@ -188,56 +891,302 @@ static inline FILE *stream_to_file(struct stream *stream)
     return *(FILE **)(stream + 1);
 }
 
-static inline void check_notify_fd(struct stream *stream, int fd)
+/* Only looks at the current state of the descriptor; waiting for it to
+ * become ready is left to stream_wait and the event loop */
+static inline void check_notify_fd(struct stream *stream, int fd,
+                                   int changed)
 {
-    if (!stream->notify)
+    if (stream->loop)
         return;
-    fd_set rfds;
-    fd_set wfds;
-    FD_ZERO(&rfds);
-    FD_ZERO(&wfds);
-    FD_SET(fd, &rfds);
-    FD_SET(fd, &wfds);
+    if (stream->notify) {
+        struct pollfd pfd = {.fd = fd, .events = POLLIN | POLLOUT};
 
-    if (select(fd + 1, &rfds, &wfds, NULL, NULL) > 0)
-        stream_notify(stream);
+        if (poll(&pfd, 1, 0) > 0)
+            stream_notify_level(stream, changed);
+    }
+    stream_notify_edges(stream, changed);
 }
 
-static int file_read(struct stream *stream, void *result, const int max_size)
+static int fd_set_nonblocking(struct stream *stream, bool enable)
 {
-    FILE *fp = stream_to_file(stream);
-    int e = fread(result, 1, max_size, fp);
-    if (e < 0)
+    int fd = stream->get_fd(stream);
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0)
         return -errno;
-    check_notify_fd(stream, fileno(fp));
-    return e;
+    flags = enable ? flags | O_NONBLOCK : flags & ~O_NONBLOCK;
+    if (fcntl(fd, F_SETFL, flags) < 0)
+        return -errno;
+    return 0;
 }
 
-static int file_write(struct stream *stream, const void *const data,
-                      const int data_len)
+#ifndef POLLRDHUP
+#define POLLRDHUP 0
+#endif
+
+/* Free space in a socket's send buffer, or just an indication that there
+ * is some where the queue size can't be read */
+static int fd_write_space(int fd, bool socket)
+{
+#ifdef SIOCOUTQ
+    int size, queued;
+    socklen_t len = sizeof(size);
+    /* The send buffer limit covers the kernel's bookkeeping as well as
+     * the data (which is why Linux doubles a requested SO_SNDBUF), while
+     * SIOCOUTQ counts data alone, so only about half of it is usable */
+    if (socket && getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, &len) == 0 &&
+        ioctl(fd, SIOCOUTQ, &queued) == 0 && size / 2 > queued)
+        return size / 2 - queued;
+#else
+    (void)fd;
+    (void)socket;
+#endif
+    return 1;
+}
+
+/* Report how much the descriptor could read and write right now without
+ * blocking. The stream is only finished once the other end has hung up
+ * and there is nothing left to read */
+static int fd_available(int fd, bool socket, int *read, int *write)
+{
+    struct pollfd pfd = {.fd = fd, .events = POLLIN | POLLOUT | POLLRDHUP};
+    int pending = 0;
+
+    if (poll(&pfd, 1, 0) < 0)
+        return -errno;
+    if (pfd.revents & (POLLERR | POLLNVAL))
+        return -EIO;
+    if ((pfd.revents & POLLIN) && ioctl(fd, FIONREAD, &pending) < 0)
+        pending = 1;
+    if (read)
+        *read = pending;
+    if (write)
+        *write = (pfd.revents & POLLOUT) ? fd_write_space(fd, socket) : 0;
+    if ((pfd.revents & (POLLHUP | POLLRDHUP)) && pending == 0)
+        return 0;
+    return 1;
+}
+
+static int file_read(struct stream *stream, void *result, const int max_size)
+{
+    FILE *fp = stream_to_file(stream);
+    int e = fread(result, 1, max_size, fp);
+    if (e < 0)
+        return -errno;
+    check_notify_fd(stream, fileno(fp), STREAM_READABLE);
+    return e;
+}
+
+static int file_write(struct stream *stream, const void *const data,
+                      const int data_len)
 {
     FILE *fp = stream_to_file(stream);
     int e = fwrite(data, 1, data_len, fp);
     if (e < 0)
         return -errno;
 
-    check_notify_fd(stream, fileno(fp));
+    check_notify_fd(stream, fileno(fp), STREAM_WRITABLE);
     return e;
 }
 
+/* stdio may already hold read-ahead that the descriptor has moved past,
+ * and fflush() on a pipe or terminal would throw it away, so reads fill
+ * each vector through stdio in turn */
+static int file_readv(struct stream *stream, const struct iovec *iov,
+                      int iovcnt)
+{
+    FILE *fp = stream_to_file(stream);
+    ssize_t total = 0;
+
+    for (int i = 0; i < iovcnt && total < INT_MAX; i++) {
+        size_t want = iov[i].iov_len;
+        if (want > (size_t)(INT_MAX - total))
+            want = INT_MAX - total;
+        size_t got = fread(iov[i].iov_base, 1, want, fp);
+        if (got == 0 && ferror(fp) && total == 0)
+            return -(errno ? errno : EIO);
+        total += got;
+        if (got < iov[i].iov_len)
+            break;
+    }
+    check_notify_fd(stream, fileno(fp), STREAM_READABLE);
+    return total;
+}
+
+/* Pending stdio output has to go first; after that the vectors can go
+ * straight to the descriptor */
+static int file_writev(struct stream *stream, const struct iovec *iov,
+                       int iovcnt)
+{
+    FILE *fp = stream_to_file(stream);
+    if (fflush(fp) < 0)
+        return -errno;
+    ssize_t e = writev(fileno(fp), iov, iovcnt);
+    if (e < 0)
+        return -errno;
+    check_notify_fd(stream, fileno(fp), STREAM_WRITABLE);
+    return e > INT_MAX ? INT_MAX : e;
+}
+
+static int file_get_fd(struct stream *stream)
+{
+    FILE *fp = stream_to_file(stream);
+    if (fflush(fp) < 0)
+        return -errno;
+    return fileno(fp);
+}
+
+static int file_flush(struct stream *stream)
+{
+    FILE *fp = stream_to_file(stream);
+    if (fflush(fp) < 0)
+        return -errno;
+    return 0;
+}
+
 static int file_close(struct stream *stream)
 {
     FILE *fp = stream_to_file(stream);
     return fclose(fp);
 }
 
-struct stream *stream_file_open(const char *file_name, const char *mode)
+/* Read-only files mapped into memory. Reads are just copies out of the
+ * mapping, and the part that has been read is unmapped as we go, so a huge
+ * file streamed from start to end doesn't stay resident */
+#define MMAP_RELEASE_SIZE (64 * 1024 * 1024)
+
+struct mmap_stream {
+    int fd;
+    uint8_t *base;
+    size_t len;
+    size_t pos;
+    size_t released; /* Bytes at the start which are no longer mapped */
+};
+
+static struct mmap_stream *stream_to_mmap(struct stream *stream)
 {
-    FILE *fp = fopen(file_name, mode);
-    if (!fp)
+    return (struct mmap_stream *)(stream + 1);
+}
+
+static void mmap_release(struct mmap_stream *map)
+{
+    if (map->pos - map->released < MMAP_RELEASE_SIZE)
+        return;
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t end = map->pos & ~(page - 1);
+    munmap(map->base + map->released, end - map->released);
+    map->released = end;
+}
+
+static int mmap_read(struct stream *stream, void *result, const int max_size)
+{
+    struct mmap_stream *map = stream_to_mmap(stream);
+    size_t size = map->len - map->pos;
+
+    if (size > (size_t)max_size)
+        size = max_size;
+    memcpy(result, map->base + map->pos, size);
+    map->pos += size;
+    mmap_release(map);
+
+    if (map->pos < map->len)
+        stream_notify(stream, STREAM_READABLE);
+
+    return size;
+}
+
+static int mmap_peek(struct stream *stream, const void **ptr, int *len)
+{
+    struct mmap_stream *map = stream_to_mmap(stream);
+    size_t remaining = map->len - map->pos;
+
+    *ptr = map->base + map->pos;
+    *len = remaining > INT_MAX ? INT_MAX : (int)remaining;
+    return *len;
+}
+
+static int mmap_consume(struct stream *stream, int len)
+{
+    struct mmap_stream *map = stream_to_mmap(stream);
+
+    if ((size_t)len > map->len - map->pos)
+        return -EINVAL;
+    map->pos += len;
+    mmap_release(map);
+
+    if (map->pos < map->len)
+        stream_notify(stream, STREAM_READABLE);
+
+    return len;
+}
+
+static int mmap_available64(struct stream *stream, int64_t *read,
+                            int64_t *write)
+{
+    struct mmap_stream *map = stream_to_mmap(stream);
+    size_t remaining = map->len - map->pos;
+
+    if (read)
+        *read = remaining;
+    if (write)
+        *write = 0;
+    return remaining ? 1 : 0;
+}
+
+static int mmap_available(struct stream *stream, int *read, int *write)
+{
+    return stream_available_int(stream, mmap_available64, read, write);
+}
+
+static int mmap_close(struct stream *stream)
+{
+    struct mmap_stream *map = stream_to_mmap(stream);
+    if (map->len > map->released)
+        munmap(map->base + map->released, map->len - map->released);
+    if (close(map->fd) < 0)
+        return -errno;
+    return 0;
+}
+
+/* Map a regular file opened read-only. On failure 'fd' is left open */
+static struct stream *stream_mmap_open(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+        return NULL;
+    struct stream *stream =
+        stream_alloc(sizeof(struct stream) + sizeof(struct mmap_stream));
+    if (!stream)
         return NULL;
+    struct mmap_stream *map = stream_to_mmap(stream);
+    map->fd = fd;
+    map->len = st.st_size;
+    if (map->len) {
+        map->base = mmap(NULL, map->len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map->base == MAP_FAILED) {
+            stream_free(stream);
+            return NULL;
+        }
+        madvise(map->base, map->len, MADV_SEQUENTIAL);
+    }
+
+    stream->read = mmap_read;
+    stream->peek = mmap_peek;
+    stream->consume = mmap_consume;
+    stream->available = mmap_available;
+    stream->available64 = mmap_available64;
+    stream->close = mmap_close;
+    return stream;
+}
+
+#ifdef __linux__
+static struct stream *stream_uring_open(int fd, bool socket, bool reading,
+                                        bool writing);
+#endif
+
+static struct stream *stream_stdio_open(FILE *fp, const char *mode)
+{
     struct stream *stream =
-        calloc(sizeof(struct stream) + sizeof(FILE **), 1);
+        stream_alloc(sizeof(struct stream) + sizeof(FILE **));
     if (!stream) {
         fclose(fp);
         return NULL;
@@ -245,14 +1194,72 @@ struct stream *stream_file_open(const char *file_name, const char *mode)
     *(FILE **)(stream + 1) = fp;
     stream->write = strchr(mode, 'w') ? file_write : NULL;
     stream->read = strchr(mode, 'r') ? file_read : NULL;
+    stream->readv = strchr(mode, 'r') ? file_readv : NULL;
+    stream->writev = strchr(mode, 'w') ? file_writev : NULL;
+    stream->get_fd = file_get_fd;
+    stream->flush = file_flush;
     stream->close = file_close;
     stream->available = NULL;
     return stream;
 }
 
+struct stream *stream_file_open(const char *file_name, const char *mode)
+{
+    if (strchr(mode, 'm') && strchr(mode, 'r') && !strchr(mode, 'w') &&
+        !strchr(mode, '+')) {
+        int fd = open(file_name, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return NULL;
+        struct stream *stream = stream_mmap_open(fd);
+        if (stream)
+            return stream;
+        /* Pipes, devices and anything else that can't be mapped are read
+         * through stdio instead, without opening them a second time */
+        FILE *fp = fdopen(fd, "r");
+        if (!fp) {
+            close(fd);
+            return NULL;
+        }
+        return stream_stdio_open(fp, "r");
+    }
+#ifdef __linux__
+    /* io_uring is only used for plain read-only or write-only access, and
+     * if it isn't available we quietly use stdio instead */
+    bool reading = strchr(mode, 'r') != NULL;
+    bool writing = strchr(mode, 'w') != NULL;
+    if (strchr(mode, 'u') && reading != writing && !strchr(mode, '+')) {
+        int fd = open(file_name,
+                      reading ? O_RDONLY : O_WRONLY | O_CREAT | O_TRUNC,
+                      0666);
+        if (fd < 0)
+            return NULL;
+        struct stream *stream = stream_uring_open(fd, false, reading,
+                                                  writing);
+        if (stream)
+            return stream;
+        close(fd);
+    }
+#endif
+    FILE *fp = fopen(file_name, mode);
+    if (!fp)
+        return NULL;
+    return stream_stdio_open(fp, mode);
+}
+
+/* Several independent xoshiro256** generators are stepped together, so the
+ * compiler can keep each state word for all of them in one vector
+ * register */
+#define RAND_LANES 4
+#define RAND_BLOCK (RAND_LANES * sizeof(uint64_t))
+
 struct rand_stream {
     int max_len;
     int pos;
+    uint64_t state[4][RAND_LANES];
+    /* Output generated but not yet returned, so results don't depend on
+     * how reads are sized */
+    uint8_t spare[RAND_BLOCK];
+    int spare_len;
 };
 
 static inline struct rand_stream *stream_to_rand(struct stream *stream)
@@ -260,35 +1267,103 @@ static inline struct rand_stream *stream_to_rand(struct stream *stream)
     return (struct rand_stream *)(stream + 1);
 }
 
+static inline uint64_t rotl64(uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+static uint64_t splitmix64(uint64_t *x)
+{
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+/* Produce one RAND_BLOCK of output, one word per lane */
+static inline void rand_next(struct rand_stream *rs, uint64_t *out)
+{
+    uint64_t(*s)[RAND_LANES] = rs->state;
+
+    for (int i = 0; i < RAND_LANES; i++) {
+        out[i] = rotl64(s[1][i] * 5, 7) * 9;
+        uint64_t t = s[1][i] << 17;
+        s[2][i] ^= s[0][i];
+        s[3][i] ^= s[1][i];
+        s[1][i] ^= s[2][i];
+        s[0][i] ^= s[3][i];
+        s[2][i] ^= t;
+        s[3][i] = rotl64(s[3][i], 45);
+    }
+}
+
 static int rand_read(struct stream *stream, void *result, int max_size)
 {
     struct rand_stream *rs = stream_to_rand(stream);
     uint8_t *r8 = result;
+    uint64_t block[RAND_LANES];
 
     if (rs->max_len >= 0 && max_size > rs->max_len - rs->pos)
         max_size = rs->max_len - rs->pos;
-    for (int i = 0; i < max_size; i++)
-        *r8++ = rand();
-    rs->pos += max_size;
-    stream_notify(stream);
+    if (max_size <= 0)
+        return 0;
+
+    int len = max_size;
+    int spare = rs->spare_len < len ? rs->spare_len : len;
+    memcpy(r8, rs->spare + RAND_BLOCK - rs->spare_len, spare);
+    rs->spare_len -= spare;
+    r8 += spare;
+    len -= spare;
+
+    for (; len >= (int)RAND_BLOCK; len -= RAND_BLOCK, r8 += RAND_BLOCK) {
+        rand_next(rs, block);
+        memcpy(r8, block, RAND_BLOCK);
+    }
+    if (len) {
+        rand_next(rs, block);
+        memcpy(rs->spare, block, RAND_BLOCK);
+        memcpy(r8, rs->spare, len);
+        rs->spare_len = RAND_BLOCK - len;
+    }
+
+    /* An unbounded stream never looks at pos, and would overflow it */
+    if (rs->max_len >= 0)
+        rs->pos += max_size;
+    stream_notify(stream, STREAM_READABLE);
     return max_size;
 }
 
-struct stream *stream_rand_open(int max_len)
+struct stream *stream_rand_open_seeded(int max_len, uint64_t seed)
 {
     struct stream *stream =
-        calloc(sizeof(struct stream) + sizeof(struct rand_stream), 1);
+        stream_alloc(sizeof(struct stream) + sizeof(struct rand_stream));
     if (!stream)
         return NULL;
     struct rand_stream *rs = stream_to_rand(stream);
     stream->read = rand_read;
     rs->max_len = max_len;
     rs->pos = 0;
+    rs->spare_len = 0;
+    for (int i = 0; i < RAND_LANES; i++)
+        for (int j = 0; j < 4; j++)
+            rs->state[j][i] = splitmix64(&seed);
     return stream;
 }
 
+struct stream *stream_rand_open(int max_len)
+{
+    static atomic_uint_fast64_t counter;
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t seed = ((uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec) ^
+                    rotl64(atomic_fetch_add(&counter, 1), 32);
+    return stream_rand_open_seeded(max_len, seed);
+}
+
 struct pipe_stream {
     int max_size;
+    int head; /* Offset of the oldest unread byte in buffer */
     int used;
     char buffer[0];
 };
@@ -298,27 +1373,71 @@ static struct pipe_stream *stream_to_pipe(struct stream *stream)
     return (struct pipe_stream *)(stream + 1);
 }
 
+/* Drop len bytes from the front of the pipe */
+static void pipe_advance(struct pipe_stream *pipe, int len)
+{
+    pipe->head += len;
+    if (pipe->head >= pipe->max_size)
+        pipe->head -= pipe->max_size;
+    pipe->used -= len;
+    /* Once empty, rewind so the next write lands contiguously */
+    if (pipe->used == 0)
+        pipe->head = 0;
+}
+
 static int pipe_read(struct stream *stream, void *result, int max_size)
 {
     struct pipe_stream *pipe = stream_to_pipe(stream);
+    uint8_t *r8 = result;
     if (max_size > pipe->used)
         max_size = pipe->used;
-    memcpy(result, pipe->buffer, max_size);
-    pipe->used -= max_size;
-    memcpy(pipe->buffer, &pipe->buffer[max_size], pipe->used);
 
-    stream_notify(stream);
+    /* The unread data may wrap around the end of the buffer, so copy it out
+     * in at most two pieces */
+    int first = pipe->max_size - pipe->head;
+    if (first > max_size)
+        first = max_size;
+    memcpy(r8, &pipe->buffer[pipe->head], first);
+    memcpy(r8 + first, pipe->buffer, max_size - first);
+    pipe_advance(pipe, max_size);
+
+    stream_notify_moved(stream, STREAM_WRITABLE);
 
     return max_size;
 }
 
+static int pipe_peek(struct stream *stream, const void **ptr, int *len)
+{
+    struct pipe_stream *pipe = stream_to_pipe(stream);
+
+    /* Only the contiguous run up to the end of the buffer is visible */
+    *ptr = &pipe->buffer[pipe->head];
+    *len = pipe->max_size - pipe->head;
+    if (*len > pipe->used)
+        *len = pipe->used;
+    return *len;
+}
+
+static int pipe_consume(struct stream *stream, int len)
+{
+    struct pipe_stream *pipe = stream_to_pipe(stream);
+
+    if (len > pipe->used)
+        return -EINVAL;
+    pipe_advance(pipe, len);
+
+    stream_notify_moved(stream, STREAM_WRITABLE);
+
+    return len;
+}
+
 static int pipe_available(struct stream *stream, int *read, int *write)
 {
     struct pipe_stream *pipe = stream_to_pipe(stream);
     if (read)
-        *read = pipe->used > 0;
+        *read = pipe->used;
     if (write)
-        *write = pipe->used < pipe->max_size;
+        *write = pipe->max_size - pipe->used;
     return 1;
 }
 
@@ -326,6 +1445,7 @@ static int pipe_write(struct stream *stream, const void *const data,
                       const int data_len)
 {
     struct pipe_stream *pipe = stream_to_pipe(stream);
+    const uint8_t *d8 = data;
     int free_space = pipe->max_size - pipe->used;
     int read_len;
     if (data_len > free_space)
@@ -333,351 +1453,3058 @@ static int pipe_write(struct stream *stream, const void *const data,
     else
         read_len = data_len;
 
-    memcpy(&pipe->buffer[pipe->used], data, read_len);
+    int tail = pipe->head + pipe->used;
+    if (tail >= pipe->max_size)
+        tail -= pipe->max_size;
+    int first = pipe->max_size - tail;
+    if (first > read_len)
+        first = read_len;
+    memcpy(&pipe->buffer[tail], d8, first);
+    memcpy(pipe->buffer, d8 + first, read_len - first);
     pipe->used += read_len;
 
-    stream_notify(stream);
+    stream_notify_moved(stream, STREAM_READABLE);
 
     return read_len;
 }
 
+size_t stream_pipe_storage_size(int buffer_size)
+{
+    return sizeof(struct stream) + sizeof(struct pipe_stream) + buffer_size;
+}
+
 struct stream *stream_pipe_open(int buffer_size)
 {
-    struct stream *stream = calloc(
-        sizeof(struct stream) + sizeof(struct pipe_stream) + buffer_size, 1);
+    if (buffer_size < 0)
+        return NULL;
+    size_t size = stream_pipe_storage_size(buffer_size);
+    void *storage = stream_alloc(size);
+    return stream_adopt(stream_pipe_init(storage, size, buffer_size),
+                        storage);
+}
+
+struct stream *stream_pipe_init(void *storage, size_t storage_len,
+                                int buffer_size)
+{
+    if (buffer_size < 0)
+        return NULL;
+    struct stream *stream = stream_from_storage(
+        storage, storage_len, stream_pipe_storage_size(buffer_size));
     if (!stream)
         return NULL;
     struct pipe_stream *pipe = stream_to_pipe(stream);
     pipe->max_size = buffer_size;
+    pipe->head = 0;
     pipe->used = 0;
     stream->read = pipe_read;
     stream->write = pipe_write;
     stream->available = pipe_available;
+    stream->peek = pipe_peek;
+    stream->consume = pipe_consume;
 
     return stream;
 }
 
-struct line_stream {
-    struct stream *parent;
-    int pos;
-    char buffer[1024];
-    int break_pos;
+/* Single producer/single consumer pipe. The consumer only ever writes
+ * 'head' and the producer only ever writes 'tail', so with acquire/release
+ * ordering the two sides can run on separate threads without a lock.
+ * head & tail are free running byte counters, and each side caches the
+ * other's counter on its own cache line to avoid bouncing it on every call.
+ */
+#define CACHE_LINE_SIZE 64
+
+struct spsc_pipe_stream {
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t head;
+    size_t tail_cache;
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t tail;
+    size_t head_cache;
+    _Alignas(CACHE_LINE_SIZE) size_t max_size;
+    char buffer[0];
 };
 
-static struct line_stream *stream_to_line(struct stream *stream)
+static struct spsc_pipe_stream *stream_to_spsc(struct stream *stream)
 {
-    return (struct line_stream *)(stream + 1);
+    uintptr_t p = (uintptr_t)(stream + 1);
+    p = (p + CACHE_LINE_SIZE - 1) & ~(uintptr_t)(CACHE_LINE_SIZE - 1);
+    return (struct spsc_pipe_stream *)p;
 }
 
-static bool is_linebreak(char ch)
+static int spsc_read(struct stream *stream, void *result, int max_size)
 {
-    return (ch == '\r' || ch == '\n' || ch == '\0');
-}
+    struct spsc_pipe_stream *pipe = stream_to_spsc(stream);
+    uint8_t *r8 = result;
+    size_t head = atomic_load_explicit(&pipe->head, memory_order_relaxed);
+    size_t size = max_size;
 
-static int line_read(struct stream *stream, void *result, int max_size)
-{
-    struct line_stream *line = stream_to_line(stream);
-    int line_len = 0;
+    if (pipe->tail_cache - head < size)
+        pipe->tail_cache =
+            atomic_load_explicit(&pipe->tail, memory_order_acquire);
+    if (size > pipe->tail_cache - head)
+        size = pipe->tail_cache - head;
 
-    /* If we don't have a line break, then read more data */
-    if (line->break_pos == -1) {
-        int e = stream_read(line->parent, &line->buffer[line->pos],
-                            sizeof(line->buffer) - line->pos);
-        if (e < 0)
-            return e;
-        line->pos += e;
+    size_t offset = head % pipe->max_size;
+    size_t first = pipe->max_size - offset;
+    if (first > size)
+        first = size;
+    memcpy(r8, &pipe->buffer[offset], first);
+    memcpy(r8 + first, pipe->buffer, size - first);
+    atomic_store_explicit(&pipe->head, head + size, memory_order_release);
 
-        for (int i = 0; i < line->pos; i++) {
-            if (is_linebreak(line->buffer[i])) {
-                line->break_pos = i;
-                break;
-            }
-        }
-    }
+    stream_notify_moved(stream, STREAM_WRITABLE);
 
-    if (line->break_pos >= 0) {
-        line_len = line->break_pos;
-        char *r_ch = result;
-        if (line_len > max_size - 1)
-            line_len = max_size - 1;
-        memcpy(result, line->buffer, line_len);
-        r_ch[line_len] = '\0';
+    return size;
+}
 
-        /* Absorb '\r\n' as one item */
-        if (line->buffer[line->break_pos] == '\r' &&
-            line->break_pos + 1 < line->pos &&
-            line->buffer[line->break_pos + 1] == '\n')
-            line->break_pos++;
-        memcpy(line->buffer, &line->buffer[line->break_pos + 1],
-               line->pos - line->break_pos - 1);
-        line->pos -= line->break_pos + 1;
-        line->break_pos = -1;
+static int spsc_write(struct stream *stream, const void *const data,
+                      const int data_len)
+{
+    struct spsc_pipe_stream *pipe = stream_to_spsc(stream);
+    const uint8_t *d8 = data;
+    size_t tail = atomic_load_explicit(&pipe->tail, memory_order_relaxed);
+    size_t size = data_len;
 
-        for (int i = 0; i < line->pos; i++) {
-            if (is_linebreak(line->buffer[i])) {
-                line->break_pos = i;
-                break;
-            }
-        }
-    }
+    if (pipe->max_size - (tail - pipe->head_cache) < size)
+        pipe->head_cache =
+            atomic_load_explicit(&pipe->head, memory_order_acquire);
+    if (size > pipe->max_size - (tail - pipe->head_cache))
+        size = pipe->max_size - (tail - pipe->head_cache);
 
-    stream_notify(stream);
+    size_t offset = tail % pipe->max_size;
+    size_t first = pipe->max_size - offset;
+    if (first > size)
+        first = size;
+    memcpy(&pipe->buffer[offset], d8, first);
+    memcpy(pipe->buffer, d8 + first, size - first);
+    atomic_store_explicit(&pipe->tail, tail + size, memory_order_release);
 
-    return line_len;
+    stream_notify_moved(stream, STREAM_READABLE);
+
+    return size;
 }
 
-static int line_available(struct stream *stream, int *read, int *write)
+static int spsc_available(struct stream *stream, int *read, int *write)
 {
-    struct line_stream *line = stream_to_line(stream);
+    struct spsc_pipe_stream *pipe = stream_to_spsc(stream);
+    size_t head = atomic_load_explicit(&pipe->head, memory_order_acquire);
+    size_t tail = atomic_load_explicit(&pipe->tail, memory_order_acquire);
     if (read)
-        *read = line->break_pos != -1;
+        *read = tail - head;
     if (write)
-        *write = 0;
-    if (line->pos > 0)
-        return 1;
-    return stream_available(line->parent, NULL, NULL);
-}
-
-static int line_close(struct stream *stream)
-{
-    struct line_stream *line = stream_to_line(stream);
-    stream_set_notify(line->parent, NULL, NULL);
-    return 0;
+        *write = pipe->max_size - (tail - head);
+    return 1;
 }
 
-struct stream *stream_line_open(struct stream *input)
+struct stream *stream_pipe_spsc_open(int buffer_size)
 {
-    if (!input->read)
+    if (buffer_size <= 0)
         return NULL;
     struct stream *stream =
-        calloc(sizeof(struct stream) + sizeof(struct line_stream), 1);
+        stream_alloc(sizeof(struct stream) + CACHE_LINE_SIZE +
+                   sizeof(struct spsc_pipe_stream) + buffer_size);
     if (!stream)
         return NULL;
-    struct line_stream *line = stream_to_line(stream);
-
-    line->parent = input;
-    line->pos = 0;
-    line->break_pos = -1;
-    stream->read = line_read;
-    stream->available = line_available;
-    stream->close = line_close;
-
-    stream_set_notify(line->parent, stream_chain_notify, stream);
+    struct spsc_pipe_stream *pipe = stream_to_spsc(stream);
+    atomic_init(&pipe->head, 0);
+    atomic_init(&pipe->tail, 0);
+    pipe->max_size = buffer_size;
+    stream->read = spsc_read;
+    stream->write = spsc_write;
+    stream->available = spsc_available;
 
     return stream;
 }
 
-struct process_stream {
-    pid_t pid;
-    int fd;
+/* A single producer/single consumer ring, like the spsc pipe, but in
+ * shared memory so the two ends can be in different processes. Sleepers
+ * on either end wait on a futex in the shared header */
+#define SHM_MAGIC 0x73686d72
+/* How long an opener waits for the creator to finish setting up */
+#define SHM_ATTACH_TRIES 1000
+
+/* Bits in shm_ring.ends */
+#define SHM_READER 0x01
+#define SHM_WRITER 0x02
+
+struct shm_ring {
+    _Atomic uint32_t magic;
+    uint32_t size;
+    /* SHM_READER/SHM_WRITER for each end that has opened the ring, so
+     * there is only ever one of each */
+    _Atomic uint32_t ends;
+    /* The writer has gone, so once drained the ring is finished */
+    _Atomic uint32_t closed;
+    /* The reader has gone, so nothing written will ever be read */
+    _Atomic uint32_t reader_closed;
+    struct stream_waitq wait;
+    _Alignas(CACHE_LINE_SIZE) _Atomic uint64_t head;
+    _Alignas(CACHE_LINE_SIZE) _Atomic uint64_t tail;
+    _Alignas(CACHE_LINE_SIZE) uint8_t buffer[];
 };
 
-struct process_stream *stream_to_process(struct stream *stream)
-{
-    return (struct process_stream *)(stream + 1);
-}
+struct shm_stream {
+    struct shm_ring *ring;
+    size_t map_len;
+    bool created; /* This end created the ring, and its name */
+    char name[NAME_MAX + 1];
+};
 
-static int process_read(struct stream *stream, void *result, int max_size)
+static struct shm_stream *stream_to_shm(struct stream *stream)
 {
-    struct process_stream *process = stream_to_process(stream);
-    int ret = read(process->fd, result, max_size);
-    if (ret < 0)
-        return -errno;
-    check_notify_fd(stream, process->fd);
-    return ret;
+    return (struct shm_stream *)(stream + 1);
 }
 
-static int process_write(struct stream *stream, const void *const data,
-                         const int data_len)
+static int shm_read(struct stream *stream, void *result, int max_size)
 {
+    struct shm_ring *ring = stream_to_shm(stream)->ring;
+    uint8_t *r8 = result;
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    size_t size = max_size;
+
+    if (max_size <= 0)
+        return 0;
+    if (size > tail - head)
+        size = tail - head;
+    if (size == 0)
+        return 0;
+
+    size_t offset = head % ring->size;
+    size_t first = ring->size - offset;
+    if (first > size)
+        first = size;
+    memcpy(r8, &ring->buffer[offset], first);
+    memcpy(r8 + first, ring->buffer, size - first);
+    atomic_store_explicit(&ring->head, head + size, memory_order_release);
+
+    stream_notify(stream, STREAM_READABLE | STREAM_WRITABLE);
+
+    return size;
+}
+
+static int shm_write(struct stream *stream, const void *const data,
+                     const int data_len)
+{
+    struct shm_ring *ring = stream_to_shm(stream)->ring;
+    const uint8_t *d8 = data;
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    size_t size = data_len;
+
+    if (atomic_load(&ring->reader_closed))
+        return -EPIPE;
+    if (data_len <= 0)
+        return 0;
+    if (size > ring->size - (tail - head))
+        size = ring->size - (tail - head);
+    if (size == 0)
+        return 0;
+
+    size_t offset = tail % ring->size;
+    size_t first = ring->size - offset;
+    if (first > size)
+        first = size;
+    memcpy(&ring->buffer[offset], d8, first);
+    memcpy(ring->buffer, d8 + first, size - first);
+    atomic_store_explicit(&ring->tail, tail + size, memory_order_release);
+
+    stream_notify(stream, STREAM_READABLE | STREAM_WRITABLE);
+
+    return size;
+}
+
+static int shm_available(struct stream *stream, int *read, int *write)
+{
+    struct shm_ring *ring = stream_to_shm(stream)->ring;
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    uint64_t used = tail - head;
+
+    if (read)
+        *read = stream->read ? used : 0;
+    if (write)
+        *write = stream->write ? ring->size - used : 0;
+    if (stream->read && used == 0 && atomic_load(&ring->closed))
+        return 0;
+    if (stream->write && atomic_load(&ring->reader_closed))
+        return 0;
+    return 1;
+}
+
+static int shm_close(struct stream *stream)
+{
+    struct shm_stream *shm = stream_to_shm(stream);
+
+    atomic_store(stream->write ? &shm->ring->closed
+                               : &shm->ring->reader_closed,
+                 1);
+    stream_wake(stream);
+    /* Once the other end has attached it has removed the name, which may
+     * since have been reused for another ring */
+    bool unlink = shm->created &&
+                  atomic_load(&shm->ring->ends) != (SHM_READER | SHM_WRITER);
+    munmap(shm->ring, shm->map_len);
+    if (unlink && shm_unlink(shm->name) < 0 && errno != ENOENT)
+        return -errno;
+    return 0;
+}
+
+/* Map a ring created by the other end, once it has been set up */
+static struct shm_ring *shm_attach(int fd, size_t *map_len)
+{
+    struct stat st;
+    struct shm_ring *ring;
+
+    for (int i = 0;; i++) {
+        if (fstat(fd, &st) < 0)
+            return NULL;
+        if ((size_t)st.st_size > sizeof(struct shm_ring))
+            break;
+        if (i == SHM_ATTACH_TRIES)
+            return NULL;
+        usleep(1000);
+    }
+    ring = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ring == MAP_FAILED)
+        return NULL;
+    for (int i = 0; atomic_load(&ring->magic) != SHM_MAGIC; i++) {
+        if (i == SHM_ATTACH_TRIES) {
+            munmap(ring, st.st_size);
+            return NULL;
+        }
+        usleep(1000);
+    }
+    if (sizeof(struct shm_ring) + ring->size > (size_t)st.st_size) {
+        munmap(ring, st.st_size);
+        return NULL;
+    }
+    *map_len = st.st_size;
+    return ring;
+}
+
+struct stream *stream_shm_open(const char *name, int size, const char *mode)
+{
+    if (!name || !mode || strlen(name) > NAME_MAX)
+        return NULL;
+    bool reading = strchr(mode, 'r') != NULL;
+    bool writing = strchr(mode, 'w') != NULL;
+    if (reading == writing)
+        return NULL;
+
+    struct shm_ring *ring;
+    size_t map_len = 0;
+    uint32_t end = reading ? SHM_READER : SHM_WRITER;
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    bool created = fd >= 0;
+    if (created) {
+        map_len = sizeof(struct shm_ring) + size;
+        if (size <= 0 || ftruncate(fd, map_len) < 0) {
+            close(fd);
+            shm_unlink(name);
+            return NULL;
+        }
+        ring = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                    0);
+        close(fd);
+        if (ring == MAP_FAILED) {
+            shm_unlink(name);
+            return NULL;
+        }
+        /* The rest of the header starts out zeroed by ftruncate */
+        ring->size = size;
+        atomic_store(&ring->ends, end);
+        atomic_store(&ring->magic, SHM_MAGIC);
+    } else {
+        if (errno != EEXIST)
+            return NULL;
+        fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+        if (fd < 0)
+            return NULL;
+        ring = shm_attach(fd, &map_len);
+        close(fd);
+        if (!ring)
+            return NULL;
+        if (atomic_fetch_or(&ring->ends, end) & end) {
+            /* This end is already taken */
+            munmap(ring, map_len);
+            errno = EBUSY;
+            return NULL;
+        }
+        /* Both ends have it mapped, so the name is no longer needed */
+        shm_unlink(name);
+    }
+
+    struct stream *stream =
+        stream_alloc(sizeof(struct stream) + sizeof(struct shm_stream));
+    if (!stream) {
+        munmap(ring, map_len);
+        if (created)
+            shm_unlink(name);
+        return NULL;
+    }
+    struct shm_stream *shm = stream_to_shm(stream);
+    shm->ring = ring;
+    shm->map_len = map_len;
+    shm->created = created;
+    strcpy(shm->name, name);
+    if (reading)
+        stream->read = shm_read;
+    if (writing)
+        stream->write = shm_write;
+    stream->available = shm_available;
+    stream->close = shm_close;
+    stream->shared_wait = &ring->wait;
+
+    return stream;
+}
+
+#define LINE_DEFAULT_SIZE 1024
+#define LINE_DEFAULT_MAX (64 * 1024)
+
+struct line_stream {
+    struct stream *parent;
+    char *buffer;
+    int size;      /* Allocated size of buffer */
+    int max_line;  /* Longer lines are split at this length */
+    int start;     /* Offset of the first unconsumed byte */
+    int pos;       /* Offset of the end of the data */
+    int break_pos; /* Offset of the end of the current line, or -1 */
+    int scan_pos;  /* Bytes before this are known not to be line breaks */
+    bool split;    /* The current line has no terminator, it was too long */
+    bool buffer_owned; /* buffer has outgrown the storage after the stream */
+};
+
+static struct line_stream *stream_to_line(struct stream *stream)
+{
+    return (struct line_stream *)(stream + 1);
+}
+
+static bool is_linebreak(char ch)
+{
+    return (ch == '\r' || ch == '\n' || ch == '\0');
+}
+
+/* Line break scanners. Each returns the first '\r', '\n' or '\0' in
+ * [p, end), or end if there isn't one */
+static const char *find_linebreak_scalar(const char *p, const char *end)
+{
+    while (p < end && !is_linebreak(*p))
+        p++;
+    return p;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2"))) static const char *
+find_linebreak_sse2(const char *p, const char *end)
+{
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+    const __m128i nul = _mm_setzero_si128();
+
+    for (; end - p >= 16; p += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        __m128i m = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf)),
+            _mm_cmpeq_epi8(v, nul));
+        int mask = _mm_movemask_epi8(m);
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+    return find_linebreak_scalar(p, end);
+}
+
+__attribute__((target("avx2"))) static const char *
+find_linebreak_avx2(const char *p, const char *end)
+{
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    const __m256i nul = _mm256_setzero_si256();
+
+    for (; end - p >= 32; p += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        __m256i m = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, cr),
+                            _mm256_cmpeq_epi8(v, lf)),
+            _mm256_cmpeq_epi8(v, nul));
+        unsigned mask = _mm256_movemask_epi8(m);
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+    return find_linebreak_sse2(p, end);
+}
+#endif
+
+static const char *find_linebreak_init(const char *p, const char *end);
+
+/* Picks the best scanner for this CPU on first use. Threads racing
+ * through the first call all pick the same one, and the pointer is
+ * atomic so that doing so is not a data race */
+static const char *(*_Atomic find_linebreak)(const char *p, const char *end) =
+    find_linebreak_init;
+
+static const char *find_linebreak_init(const char *p, const char *end)
+{
+    const char *(*scan)(const char *p, const char *end);
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        scan = find_linebreak_avx2;
+    else if (__builtin_cpu_supports("sse2"))
+        scan = find_linebreak_sse2;
+    else
+        scan = find_linebreak_scalar;
+#else
+    scan = find_linebreak_scalar;
+#endif
+    atomic_store_explicit(&find_linebreak, scan, memory_order_relaxed);
+    return scan(p, end);
+}
+
+/* Look for the next line break, starting from where the last scan stopped
+ * so that no byte is examined twice */
+static void line_scan(struct line_stream *line)
+{
+    if (line->break_pos >= 0)
+        return;
+    const char *end = &line->buffer[line->pos];
+    const char *found = find_linebreak(&line->buffer[line->scan_pos], end);
+    int limit = line->start + line->max_line;
+    line->scan_pos = found - line->buffer;
+    if (found < end && line->scan_pos <= limit) {
+        line->break_pos = line->scan_pos;
+    } else if (line->pos >= limit) {
+        line->break_pos = limit;
+        line->split = true;
+    }
+}
+
+/* Move the unconsumed data back to the start of the buffer */
+static void line_compact(struct line_stream *line)
+{
+    memmove(line->buffer, &line->buffer[line->start],
+            line->pos - line->start);
+    line->pos -= line->start;
+    line->scan_pos -= line->start;
+    if (line->break_pos >= 0)
+        line->break_pos -= line->start;
+    line->start = 0;
+}
+
+/* If we don't have a line break, then read more data */
+static int line_fill(struct line_stream *line)
+{
+    while (line->break_pos == -1) {
+        /* Only shuffle the data down once the space after it runs low,
+         * rather than after every line */
+        if (line->start > 0 && line->size - line->pos < line->size / 4)
+            line_compact(line);
+        if (line->pos == line->size) {
+            int size = line->size * 2;
+            /* Room for a maximum length line plus a '\r\n' */
+            if (size > line->max_line + 2)
+                size = line->max_line + 2;
+            char *buffer = stream_alloc(size);
+            if (!buffer)
+                return -ENOMEM;
+            memcpy(buffer, line->buffer, line->pos);
+            if (line->buffer_owned)
+                stream_free(line->buffer);
+            line->buffer = buffer;
+            line->buffer_owned = true;
+            line->size = size;
+        }
+
+        int space = line->size - line->pos;
+        int e = stream_read(line->parent, &line->buffer[line->pos], space);
+        if (e < 0)
+            return e;
+        line->pos += e;
+        line_scan(line);
+
+        /* Filling the buffer without finding a break grows it and reads
+         * again, but only while the parent can say that won't block */
+        int more = 0;
+        if (e < space || !line->parent->available ||
+            stream_available(line->parent, &more, NULL) <= 0 || more <= 0)
+            break;
+    }
+    return 0;
+}
+
+/* Remove len bytes from the front of the data. Reaching the end of the
+ * current line removes its terminator too */
+static void line_discard(struct line_stream *line, int len)
+{
+    if (line->break_pos >= 0 && len >= line->break_pos - line->start) {
+        int end = line->break_pos;
+        if (!line->split) {
+            end++;
+            /* Absorb '\r\n' as one item */
+            if (line->buffer[line->break_pos] == '\r' && end < line->pos &&
+                line->buffer[end] == '\n')
+                end++;
+            /* Nothing after the break has been scanned yet */
+            line->scan_pos = end;
+        }
+        line->start = end;
+        line->break_pos = -1;
+        line->split = false;
+    } else {
+        line->start += len;
+    }
+    if (line->start == line->pos)
+        line->start = line->pos = line->scan_pos = 0;
+    line_scan(line);
+}
+
+static int line_read(struct stream *stream, void *result, int max_size)
+{
+    struct line_stream *line = stream_to_line(stream);
+    int line_len = 0;
+
+    int e = line_fill(line);
+    if (e < 0)
+        return e;
+
+    if (line->break_pos >= 0) {
+        line_len = line->break_pos - line->start;
+        char *r_ch = result;
+        if (line_len > max_size - 1)
+            line_len = max_size - 1;
+        memcpy(result, &line->buffer[line->start], line_len);
+        r_ch[line_len] = '\0';
+        line_discard(line, line->break_pos - line->start);
+    }
+
+    stream_notify(stream, STREAM_READABLE);
+
+    return line_len;
+}
+
+static int line_next(struct stream *stream, const char **ptr, int *len)
+{
+    struct line_stream *line = stream_to_line(stream);
+
+    int e = line_fill(line);
+    if (e < 0)
+        return e;
+    if (line->break_pos < 0)
+        return 0;
+
+    /* Discarding only moves 'start', so the line stays where it is until
+     * the next fill */
+    *ptr = &line->buffer[line->start];
+    *len = line->break_pos - line->start;
+    line_discard(line, *len);
+
+    stream_notify(stream, STREAM_READABLE);
+
+    return 1;
+}
+
+int stream_line_next(struct stream *stream, const char **ptr, int *len)
+{
+    if (!stream || stream->read != line_read || !ptr || !len)
+        return -EINVAL;
+    if (!stream->stats)
+        return line_next(stream, ptr, len);
+    /* Counted as a read of the line, which is never short */
+    uint64_t start = stream_now_ns();
+    int e = line_next(stream, ptr, len);
+    int bytes = e > 0 ? *len : e;
+    stats_record(stream, true, bytes > 0 ? bytes : 0, bytes, start);
+    return e;
+}
+
+/* Peeking a line stream exposes the current line, without its terminator.
+ * Empty lines are passed over, as consuming nothing can't remove them */
+static int line_peek(struct stream *stream, const void **ptr, int *len)
+{
+    struct line_stream *line = stream_to_line(stream);
+
+    int e = line_fill(line);
+    while (e >= 0 && line->break_pos == line->start) {
+        line_discard(line, 0);
+        e = line_fill(line);
+    }
+    if (e < 0)
+        return e;
+    *ptr = &line->buffer[line->start];
+    *len = line->break_pos >= 0 ? line->break_pos - line->start : 0;
+    return *len;
+}
+
+static int line_consume(struct stream *stream, int len)
+{
+    struct line_stream *line = stream_to_line(stream);
+
+    if (line->break_pos < 0 || len > line->break_pos - line->start)
+        return -EINVAL;
+    if (len == 0)
+        return 0;
+    line_discard(line, len);
+
+    stream_notify(stream, STREAM_READABLE);
+
+    return len;
+}
+
+static int stream_peek_held(struct stream *stream, const void **ptr,
+                            int *len);
+
+static int line_available(struct stream *stream, int *read, int *write)
+{
+    struct line_stream *line = stream_to_line(stream);
+    int parent_read = 0;
+    int e = stream_available(line->parent, &parent_read, NULL);
+    /* Only a whole line, or the end of the input, makes a read worthwhile.
+     * A line that fills the buffer is split by line_scan, so shows up as a
+     * break too */
+    bool readable = line->break_pos >= 0 || e == 0;
+    if (!readable && e > 0 && parent_read > 0) {
+        /* Look for the end of the line in what the parent already holds,
+         * without reading it. If that can't all be seen, a read might
+         * still finish the line */
+        const void *ptr;
+        int len;
+        if (stream_peek_held(line->parent, &ptr, &len) < 0 ||
+            len < parent_read)
+            readable = true;
+        else
+            readable = find_linebreak(ptr, (const char *)ptr + len) !=
+                           (const char *)ptr + len ||
+                       line->pos - line->start + len >= line->max_line;
+    }
+    if (read)
+        *read = readable;
+    if (write)
+        *write = 0;
+    if (line->pos > line->start)
+        return 1;
+    return e;
+}
+
+static int line_close(struct stream *stream)
+{
+    struct line_stream *line = stream_to_line(stream);
+    stream_set_notify(line->parent, NULL, NULL);
+    if (line->buffer_owned)
+        stream_free(line->buffer);
+    return 0;
+}
+
+struct stream *stream_line_open(struct stream *input)
+{
+    return stream_line_open_ex(input, LINE_DEFAULT_SIZE, LINE_DEFAULT_MAX);
+}
+
+size_t stream_line_storage_size(int initial_size)
+{
+    if (initial_size < 0)
+        initial_size = 0;
+    return sizeof(struct stream) + sizeof(struct line_stream) + initial_size;
+}
+
+struct stream *stream_line_open_ex(struct stream *input, int initial_size,
+                                   int max_line)
+{
+    if (max_line > 0 && max_line <= INT_MAX - 2 &&
+        initial_size > max_line + 2)
+        initial_size = max_line + 2;
+    size_t size = stream_line_storage_size(initial_size);
+    void *storage = stream_alloc(size);
+    return stream_adopt(
+        stream_line_init(storage, size, input, initial_size, max_line),
+        storage);
+}
+
+struct stream *stream_line_init(void *storage, size_t storage_len,
+                                struct stream *input, int initial_size,
+                                int max_line)
+{
+    if (!input || !input->read || initial_size <= 0 || max_line <= 0 ||
+        max_line > INT_MAX - 2)
+        return NULL;
+    if (initial_size > max_line + 2)
+        initial_size = max_line + 2;
+    struct stream *stream = stream_from_storage(
+        storage, storage_len, stream_line_storage_size(initial_size));
+    if (!stream)
+        return NULL;
+    struct line_stream *line = stream_to_line(stream);
+
+    /* The initial buffer lives straight after the stream */
+    line->buffer = (char *)(line + 1);
+    line->parent = input;
+    line->size = initial_size;
+    line->max_line = max_line;
+    line->start = 0;
+    line->pos = 0;
+    line->break_pos = -1;
+    line->scan_pos = 0;
+    stream->read = line_read;
+    stream->available = line_available;
+    stream->close = line_close;
+    stream->peek = line_peek;
+    stream->consume = line_consume;
+
+    stream->parent = line->parent;
+    stream_set_notify(line->parent, stream_chain_notify, stream);
+
+    return stream;
+}
+
+/* Read-ahead and write coalescing on top of another stream */
+struct buffered_stream {
+    struct stream *parent;
+    uint8_t *rbuf;
+    int rsize;
+    int rstart;
+    int rend;
+    uint8_t *wbuf;
+    int wsize;
+    int wlen;
+};
+
+static struct buffered_stream *stream_to_buffered(struct stream *stream)
+{
+    return (struct buffered_stream *)(stream + 1);
+}
+
+static int buffered_flush(struct stream *stream)
+{
+    struct buffered_stream *buf = stream_to_buffered(stream);
+    int done = 0;
+
+    while (done < buf->wlen) {
+        int e = stream_write(buf->parent, &buf->wbuf[done], buf->wlen - done);
+        if (e < 0 || e == 0) {
+            /* Keep whatever didn't make it for next time */
+            memmove(buf->wbuf, &buf->wbuf[done], buf->wlen - done);
+            buf->wlen -= done;
+            return e < 0 ? e : -EAGAIN;
+        }
+        done += e;
+    }
+    buf->wlen = 0;
+    return stream_flush(buf->parent);
+}
+
+static int buffered_read(struct stream *stream, void *result, int max_size)
+{
+    struct buffered_stream *buf = stream_to_buffered(stream);
+
+    if (buf->rstart == buf->rend) {
+        /* Anything we've been asked to send may be what prompts the data
+         * we're about to wait for */
+        if (buf->wlen) {
+            int e = buffered_flush(stream);
+            if (e < 0)
+                return e;
+        }
+        /* Big reads go straight through */
+        if (max_size >= buf->rsize)
+            return stream_read(buf->parent, result, max_size);
+        int e = stream_read(buf->parent, buf->rbuf, buf->rsize);
+        if (e <= 0)
+            return e;
+        buf->rstart = 0;
+        buf->rend = e;
+    }
+
+    int len = buf->rend - buf->rstart;
+    if (len > max_size)
+        len = max_size;
+    memcpy(result, &buf->rbuf[buf->rstart], len);
+    buf->rstart += len;
+    return len;
+}
+
+static int buffered_write(struct stream *stream, const void *const data,
+                          const int data_len)
+{
+    struct buffered_stream *buf = stream_to_buffered(stream);
+
+    if (!buf->wsize)
+        return stream_write(buf->parent, data, data_len);
+    if (buf->wlen + data_len > buf->wsize) {
+        int e = buffered_flush(stream);
+        if (e < 0 && e != -EAGAIN)
+            return e;
+        /* Big writes go straight through once the buffer is empty */
+        if (buf->wlen == 0 && data_len >= buf->wsize)
+            return stream_write(buf->parent, data, data_len);
+    }
+
+    int len = buf->wsize - buf->wlen;
+    if (len > data_len)
+        len = data_len;
+    memcpy(&buf->wbuf[buf->wlen], data, len);
+    buf->wlen += len;
+    if (buf->wlen == buf->wsize) {
+        int e = buffered_flush(stream);
+        if (e < 0 && e != -EAGAIN) {
+            /* Take back whatever is still buffered of this write, so the
+             * caller isn't told it was accepted */
+            int unsent = buf->wlen < len ? buf->wlen : len;
+            buf->wlen -= unsent;
+            len -= unsent;
+            return len ? len : e;
+        }
+    }
+    return len;
+}
+
+static int buffered_peek(struct stream *stream, const void **ptr, int *len)
+{
+    struct buffered_stream *buf = stream_to_buffered(stream);
+
+    if (buf->rstart == buf->rend) {
+        if (buf->wlen) {
+            int e = buffered_flush(stream);
+            if (e < 0)
+                return e;
+        }
+        int e = stream_read(buf->parent, buf->rbuf, buf->rsize);
+        if (e < 0)
+            return e;
+        buf->rstart = 0;
+        buf->rend = e;
+    }
+    *ptr = &buf->rbuf[buf->rstart];
+    *len = buf->rend - buf->rstart;
+    return *len;
+}
+
+/* Expose the data a stream already holds in memory, without reading or
+ * flushing anything to get more. -EAGAIN if it can't be seen that way */
+static int stream_peek_held(struct stream *stream, const void **ptr,
+                            int *len)
+{
+    if (stream->peek_pos < stream->peek_len) {
+        *ptr = &stream->peek_buf[stream->peek_pos];
+        *len = stream->peek_len - stream->peek_pos;
+        return *len;
+    }
+    if (stream->peek == mem_peek || stream->peek == mmap_peek ||
+        stream->peek == pipe_peek)
+        return stream->peek(stream, ptr, len);
+    if (stream->peek == buffered_peek) {
+        struct buffered_stream *buf = stream_to_buffered(stream);
+        if (buf->rstart < buf->rend)
+            return buffered_peek(stream, ptr, len);
+    }
+    return -EAGAIN;
+}
+
+static int buffered_consume(struct stream *stream, int len)
+{
+    struct buffered_stream *buf = stream_to_buffered(stream);
+
+    if (len > buf->rend - buf->rstart)
+        return -EINVAL;
+    buf->rstart += len;
+    return len;
+}
+
+static int buffered_available(struct stream *stream, int *read, int *write)
+{
+    struct buffered_stream *buf = stream_to_buffered(stream);
+    int r = 0, w = 0;
+
+    int e = stream_available(buf->parent, &r, &w);
+    if (e < 0)
+        return e;
+    if (read) {
+        int pending = buf->rend - buf->rstart;
+        *read = !stream->read          ? 0
+                : r > INT_MAX - pending ? INT_MAX
+                                        : r + pending;
+    }
+    if (write)
+        *write = stream->write ? buf->wsize - buf->wlen : 0;
+    if (buf->rend > buf->rstart || buf->wlen)
+        return 1;
+    return e;
+}
+
+static int buffered_close(struct stream *stream)
+{
+    struct buffered_stream *buf = stream_to_buffered(stream);
+    int ret = 0;
+    if (buf->wlen)
+        ret = buffered_flush(stream);
+    stream_set_notify(buf->parent, NULL, NULL);
+    stream_free(buf->rbuf);
+    stream_free(buf->wbuf);
+    return ret;
+}
+
+struct stream *stream_buffered_open(struct stream *parent, int read_size,
+                                    int write_size)
+{
+    if (!parent || read_size < 0 || write_size < 0)
+        return NULL;
+    struct stream *stream =
+        stream_alloc(sizeof(struct stream) + sizeof(struct buffered_stream));
+    if (!stream)
+        return NULL;
+    struct buffered_stream *buf = stream_to_buffered(stream);
+
+    buf->parent = parent;
+    if (parent->read) {
+        stream->read = buffered_read;
+        if (read_size) {
+            buf->rbuf = stream_alloc(read_size);
+            buf->rsize = read_size;
+            stream->peek = buffered_peek;
+            stream->consume = buffered_consume;
+        }
+    }
+    if (parent->write) {
+        stream->write = buffered_write;
+        if (write_size) {
+            buf->wbuf = stream_alloc(write_size);
+            buf->wsize = write_size;
+        }
+    }
+    if ((read_size && parent->read && !buf->rbuf) ||
+        (write_size && parent->write && !buf->wbuf)) {
+        stream_free(buf->rbuf);
+        stream_free(buf->wbuf);
+        stream_free(stream);
+        return NULL;
+    }
+    stream->available = buffered_available;
+    stream->flush = buffered_flush;
+    stream->close = buffered_close;
+
+    stream->parent = parent;
+    stream_set_notify(parent, stream_chain_notify, stream);
+
+    return stream;
+}
+
+struct process_stream {
+    pid_t pid;
+    int fd;
+};
+
+struct process_stream *stream_to_process(struct stream *stream)
+{
+    return (struct process_stream *)(stream + 1);
+}
+
+static int process_read(struct stream *stream, void *result, int max_size)
+{
+    struct process_stream *process = stream_to_process(stream);
+    int ret = read(process->fd, result, max_size);
+    if (ret < 0)
+        return -errno;
+    check_notify_fd(stream, process->fd, STREAM_READABLE);
+    return ret;
+}
+
+static int process_write(struct stream *stream, const void *const data,
+                         const int data_len)
+{
+    struct process_stream *process = stream_to_process(stream);
+    int ret = write(process->fd, data, data_len);
+    if (ret < 0)
+        return -errno;
+    check_notify_fd(stream, process->fd, STREAM_WRITABLE);
+    return ret;
+}
+
+static int process_readv(struct stream *stream, const struct iovec *iov,
+                         int iovcnt)
+{
+    struct process_stream *process = stream_to_process(stream);
+    int ret = readv(process->fd, iov, iovcnt);
+    if (ret < 0)
+        return -errno;
+    check_notify_fd(stream, process->fd, STREAM_READABLE);
+    return ret;
+}
+
+static int process_writev(struct stream *stream, const struct iovec *iov,
+                          int iovcnt)
+{
+    struct process_stream *process = stream_to_process(stream);
+    int ret = writev(process->fd, iov, iovcnt);
+    if (ret < 0)
+        return -errno;
+    check_notify_fd(stream, process->fd, STREAM_WRITABLE);
+    return ret;
+}
+
+static int process_available(struct stream *stream, int *read, int *write)
+{
+    return fd_available(stream_to_process(stream)->fd, false, read, write);
+}
+
+static int process_get_fd(struct stream *stream)
+{
+    return stream_to_process(stream)->fd;
+}
+
+static int process_close(struct stream *stream)
+{
+    int i;
     struct process_stream *process = stream_to_process(stream);
-    int ret = write(process->fd, data, data_len);
-    if (ret < 0)
+    kill(process->pid, SIGTERM);
+    // Loop for 1s waiting for the process to die
+    for (i = 0; i < 10; i++) {
+        if (kill(process->pid, 0) < 0)
+            break;
+        usleep(100 * 1000);
+    }
+    // It didn't die nicely, so just hard kill it
+    if (i == 10)
+        kill(process->pid, SIGKILL);
+    waitpid(process->pid, NULL, 0);
+    close(process->fd);
+    return 0;
+}
+
+struct stream *stream_process_open(char *const *args)
+{
+    pid_t pid;
+    int fd;
+
+    pid = forkpty(&fd, NULL, NULL, NULL);
+
+    if (pid < 0) {
+        return NULL;
+    } else if (pid == 0) {
+        // This is the child process
+        execvp(args[0], args);
+        return NULL;
+    }
+
+    struct stream *stream =
+        stream_alloc(sizeof(struct stream) + sizeof(struct process_stream));
+    if (!stream) {
+        close(fd);
+        kill(pid, SIGKILL);
+        return NULL;
+    }
+    struct process_stream *process = stream_to_process(stream);
+    process->pid = pid;
+    process->fd = fd;
+    stream->write = process_write;
+    stream->read = process_read;
+    stream->readv = process_readv;
+    stream->writev = process_writev;
+    stream->get_fd = process_get_fd;
+    stream->set_nonblocking = fd_set_nonblocking;
+    stream->close = process_close;
+    stream->available = process_available;
+    return stream;
+}
+
+/* Private tcp_stream flag, marking a unix domain socket */
+#define TCP_UNIX_SOCKET 0x10000
+
+struct tcp_stream {
+    int fd;
+    /* STREAM_TCP_* flags, passed on to accepted connections */
+    int flags;
+};
+
+struct tcp_stream *stream_to_tcp(struct stream *stream)
+{
+    return (struct tcp_stream *)(stream + 1);
+}
+
+/* A packet too big for the buffer has had its tail dropped by the
+ * kernel, so fail rather than hand back part of it */
+static int tcp_recvmsg(struct stream *stream, struct msghdr *msg, int flags)
+{
+    struct tcp_stream *tcp = stream_to_tcp(stream);
+
+    int n = recvmsg(tcp->fd, msg, flags);
+    if (n < 0)
+        return -errno;
+    if (msg->msg_flags & MSG_TRUNC)
+        n = -EMSGSIZE;
+    check_notify_fd(stream, tcp->fd, STREAM_READABLE);
+    return n;
+}
+
+static int tcp_read(struct stream *stream, void *result, int max_size)
+{
+    struct tcp_stream *tcp = stream_to_tcp(stream);
+
+    if (tcp->flags & STREAM_UNIX_SEQPACKET) {
+        struct iovec iov = {.iov_base = result, .iov_len = max_size};
+        struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+        return tcp_recvmsg(stream, &msg, 0);
+    }
+
+    int n = recv(tcp->fd, result, max_size, 0);
+    if (n < 0)
+        return -errno;
+
+    check_notify_fd(stream, tcp->fd, STREAM_READABLE);
+
+    return n;
+}
+
+static int tcp_available(struct stream *stream, int *read, int *write)
+{
+    return fd_available(stream_to_tcp(stream)->fd, true, read, write);
+}
+
+static int tcp_write(struct stream *stream, const void *const data,
+                     const int data_len)
+{
+    struct tcp_stream *tcp = stream_to_tcp(stream);
+
+    int n = send(tcp->fd, data, data_len, 0);
+    if (n < 0)
+        return -errno;
+    check_notify_fd(stream, tcp->fd, STREAM_WRITABLE);
+    return n;
+}
+
+static int tcp_readv(struct stream *stream, const struct iovec *iov,
+                     int iovcnt)
+{
+    struct msghdr msg = {
+        .msg_iov = (struct iovec *)iov,
+        .msg_iovlen = iovcnt,
+    };
+
+    return tcp_recvmsg(stream, &msg, 0);
+}
+
+/* Send all the vectors with one syscall, so a header/payload/trailer can
+ * leave in a single packet */
+static int tcp_writev(struct stream *stream, const struct iovec *iov,
+                      int iovcnt)
+{
+    struct tcp_stream *tcp = stream_to_tcp(stream);
+    struct msghdr msg = {
+        .msg_iov = (struct iovec *)iov,
+        .msg_iovlen = iovcnt,
+    };
+
+    int n = sendmsg(tcp->fd, &msg, 0);
+    if (n < 0)
+        return -errno;
+    check_notify_fd(stream, tcp->fd, STREAM_WRITABLE);
+    return n;
+}
+
+static int tcp_get_fd(struct stream *stream)
+{
+    return stream_to_tcp(stream)->fd;
+}
+
+static int tcp_close(struct stream *stream)
+{
+    struct tcp_stream *tcp = stream_to_tcp(stream);
+    if (close(tcp->fd) < 0)
+        return -errno;
+    return 0;
+}
+
+/* Wrap a connected socket, taking ownership of it */
+static struct stream *tcp_stream_open_fd(int sockfd, int flags)
+{
+#ifdef __linux__
+    if (flags & STREAM_TCP_IO_URING) {
+        struct stream *stream = stream_uring_open(sockfd, true, true, true);
+        if (stream)
+            return stream;
+    }
+#endif
+
+    struct stream *stream =
+        stream_alloc(sizeof(struct stream) + sizeof(struct tcp_stream));
+    if (!stream) {
+        close(sockfd);
+        return NULL;
+    }
+    struct tcp_stream *tcp = stream_to_tcp(stream);
+    tcp->fd = sockfd;
+    tcp->flags = flags;
+
+    stream->read = tcp_read;
+    stream->write = tcp_write;
+    stream->readv = tcp_readv;
+    stream->writev = tcp_writev;
+    stream->get_fd = tcp_get_fd;
+    stream->set_nonblocking = fd_set_nonblocking;
+    stream->available = tcp_available;
+    stream->close = tcp_close;
+
+    return stream;
+}
+
+struct stream *stream_tcp_open(const char *host, int port)
+{
+    return stream_tcp_open_ex(host, port, 0);
+}
+
+struct stream *stream_tcp_open_ex(const char *host, int port, int flags)
+{
+    int sockfd;
+    struct hostent *he;
+    struct sockaddr_in addr = {};
+    int enable = 1;
+
+    he = gethostbyname(host);
+    if (!he) {
+        perror("gethostbyname");
+        return NULL;
+    }
+
+    sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0) {
+        perror("socket");
+        return NULL;
+    }
+
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) <
+        0)
+        perror("SO_REUSEADDR");
+
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr = *((struct in_addr *)he->h_addr);
+
+    if (connect(sockfd, (struct sockaddr *)&addr, sizeof(struct sockaddr)) ==
+        -1) {
+        perror("connect");
+        close(sockfd);
+        return NULL;
+    }
+
+    return tcp_stream_open_fd(sockfd, flags);
+}
+
+static int tcp_listen_available(struct stream *stream, int *read,
+                                int *write)
+{
+    /* Readable means there is a connection waiting to be accepted */
+    struct pollfd pfd = {.fd = stream_to_tcp(stream)->fd, .events = POLLIN};
+
+    if (poll(&pfd, 1, 0) < 0)
+        return -errno;
+    if (read)
+        *read = (pfd.revents & POLLIN) ? 1 : 0;
+    if (write)
+        *write = 0;
+    return 1;
+}
+
+/* Wrap a listening socket, taking ownership of it */
+static struct stream *tcp_listener_open_fd(int sockfd, int flags,
+                                           int (*close_fn)(struct stream *))
+{
+    struct stream *stream =
+        stream_alloc(sizeof(struct stream) + sizeof(struct tcp_stream));
+    if (!stream) {
+        close(sockfd);
+        return NULL;
+    }
+    struct tcp_stream *tcp = stream_to_tcp(stream);
+    tcp->fd = sockfd;
+    tcp->flags = flags;
+
+    stream->get_fd = tcp_get_fd;
+    stream->set_nonblocking = fd_set_nonblocking;
+    stream->available = tcp_listen_available;
+    stream->close = close_fn;
+
+    return stream;
+}
+
+struct stream *stream_tcp_listen(const char *host, int port, int backlog,
+                                 int flags)
+{
+    int sockfd;
+    struct sockaddr_in addr = {};
+    int enable = 1;
+
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (host) {
+        struct hostent *he = gethostbyname(host);
+        if (!he) {
+            perror("gethostbyname");
+            return NULL;
+        }
+        addr.sin_addr = *((struct in_addr *)he->h_addr);
+    } else {
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    }
+
+    sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0) {
+        perror("socket");
+        return NULL;
+    }
+
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) <
+        0)
+        perror("SO_REUSEADDR");
+    if ((flags & STREAM_TCP_REUSEPORT) &&
+        setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int)) <
+            0) {
+        perror("SO_REUSEPORT");
+        close(sockfd);
+        return NULL;
+    }
+
+    if (bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(sockfd, backlog) < 0) {
+        perror("listen");
+        close(sockfd);
+        return NULL;
+    }
+
+    return tcp_listener_open_fd(sockfd, flags, tcp_close);
+}
+
+struct stream *stream_tcp_accept(struct stream *listener)
+{
+    if (!listener || listener->available != tcp_listen_available) {
+        errno = EINVAL;
+        return NULL;
+    }
+    struct tcp_stream *tcp = stream_to_tcp(listener);
+
+    int fd = accept4(tcp->fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    /* Only the edge state needs refreshing: tcp_listen_available is a zero
+     * timeout POLLIN check, so this never waits on the listener */
+    if (!listener->loop)
+        stream_notify_edges(listener, STREAM_READABLE);
+    return tcp_stream_open_fd(fd, tcp->flags);
+}
+
+/*******
+ * UNIX SOCKETS
+ *
+ * Connected unix sockets share the tcp stream implementation, as only the
+ * addressing differs
+ *******/
+static int unix_address(const char *path, struct sockaddr_un *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (!path || strlen(path) >= sizeof(addr->sun_path))
+        return -ENAMETOOLONG;
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+static int unix_socket_type(int flags)
+{
+    return (flags & STREAM_UNIX_SEQPACKET) ? SOCK_SEQPACKET : SOCK_STREAM;
+}
+
+struct stream *stream_unix_open(const char *path)
+{
+    return stream_unix_open_ex(path, 0);
+}
+
+struct stream *stream_unix_open_ex(const char *path, int flags)
+{
+    struct sockaddr_un addr;
+
+    if (unix_address(path, &addr) < 0) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    int sockfd = socket(AF_UNIX, unix_socket_type(flags) | SOCK_CLOEXEC, 0);
+    if (sockfd < 0) {
+        perror("socket");
+        return NULL;
+    }
+    if (connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("connect");
+        close(sockfd);
+        return NULL;
+    }
+    return tcp_stream_open_fd(sockfd, flags | TCP_UNIX_SOCKET);
+}
+
+/* The listener created the socket file, so it removes it again */
+static int unix_listen_close(struct stream *stream)
+{
+    struct sockaddr_un addr;
+    socklen_t len = sizeof(addr);
+    int fd = stream_to_tcp(stream)->fd;
+
+    if (getsockname(fd, (struct sockaddr *)&addr, &len) == 0 &&
+        len > offsetof(struct sockaddr_un, sun_path) && addr.sun_path[0])
+        unlink(addr.sun_path);
+    return tcp_close(stream);
+}
+
+struct stream *stream_unix_listen(const char *path, int backlog, int flags)
+{
+    struct sockaddr_un addr;
+
+    if (unix_address(path, &addr) < 0) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    int sockfd = socket(AF_UNIX, unix_socket_type(flags) | SOCK_CLOEXEC, 0);
+    if (sockfd < 0) {
+        perror("socket");
+        return NULL;
+    }
+    if (bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(sockfd, backlog) < 0) {
+        perror("listen");
+        close(sockfd);
+        return NULL;
+    }
+    return tcp_listener_open_fd(sockfd, flags | TCP_UNIX_SOCKET,
+                                unix_listen_close);
+}
+
+struct stream *stream_unix_accept(struct stream *listener)
+{
+    return stream_tcp_accept(listener);
+}
+
+static bool is_unix_stream(struct stream *stream)
+{
+    return stream->read == tcp_read &&
+           (stream_to_tcp(stream)->flags & TCP_UNIX_SOCKET);
+}
+
+int stream_unix_send_fds(struct stream *stream, const void *data, int len,
+                         const int *fds, int nfds)
+{
+    if (!stream || !is_unix_stream(stream) || !data || len <= 0 ||
+        nfds < 0 || nfds > STREAM_UNIX_MAX_FDS || (nfds && !fds))
+        return -EINVAL;
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * STREAM_UNIX_MAX_FDS)];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {.iov_base = (void *)data, .iov_len = len};
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+    };
+
+    if (nfds) {
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+    }
+
+    int n = sendmsg(stream_to_tcp(stream)->fd, &msg, MSG_NOSIGNAL);
+    if (n < 0)
         return -errno;
-    check_notify_fd(stream, process->fd);
-    return ret;
+    check_notify_fd(stream, stream_to_tcp(stream)->fd, STREAM_WRITABLE);
+    return n;
 }
 
-static int process_close(struct stream *stream)
+int stream_unix_recv_fds(struct stream *stream, void *data, int max_size,
+                         int *fds, int *nfds)
 {
-    int i;
-    struct process_stream *process = stream_to_process(stream);
-    kill(process->pid, SIGTERM);
-    // Loop for 1s waiting for the process to die
-    for (i = 0; i < 10; i++) {
-        if (kill(process->pid, 0) < 0)
+    if (!stream || !is_unix_stream(stream) || !data || max_size <= 0 ||
+        !nfds || *nfds < 0 || (*nfds && !fds))
+        return -EINVAL;
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * STREAM_UNIX_MAX_FDS)];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {.iov_base = data, .iov_len = max_size};
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+    int received = 0;
+
+    int n = tcp_recvmsg(stream, &msg, MSG_CMSG_CLOEXEC);
+    if (n < 0 && n != -EMSGSIZE)
+        return n;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        int *passed = (int *)CMSG_DATA(cmsg);
+        for (int i = 0; i < count; i++) {
+            /* Close any that the caller has no room for, or all of them
+             * if the data is being thrown away */
+            if (n >= 0 && received < *nfds)
+                fds[received++] = passed[i];
+            else
+                close(passed[i]);
+        }
+    }
+    *nfds = received;
+    return n;
+}
+
+/*******
+ * IO_URING
+ *******/
+#ifdef __linux__
+/* Minimal raw-syscall io_uring driver used by the file & tcp streams when
+ * opened with the io_uring option. Each stream owns a ring, and keeps:
+ *  - two registered write slots: one being written by the kernel while the
+ *    other collects further writes, so a burst of small writes turns into
+ *    a few large submissions
+ *  - for files, two registered read slots kept full by read-ahead
+ *  - for sockets, a provided buffer ring fed to a multishot recv, so data
+ *    arriving on the socket is queued without a syscall per read
+ */
+#define URING_ENTRIES 16
+#define URING_SLOT_SIZE (64 * 1024)
+#define URING_RECV_BUFFERS 8 /* Must be a power of 2 */
+#define URING_RECV_SIZE (16 * 1024)
+#define URING_BGID 0
+/* Consecutive -EAGAIN completions a write may see before giving up */
+#define URING_WRITE_RETRIES 16
+
+enum { URING_OP_READ, URING_OP_WRITE, URING_OP_RECV, URING_OP_CANCEL };
+#define URING_DATA(op, slot) (((uint64_t)(op) << 8) | (slot))
+
+struct uring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned sqe_tail; /* Local tail, published on the next enter */
+    void *ring_ptr;
+    size_t ring_size;
+    size_t sqes_size;
+};
+
+static int uring_init(struct uring *ring, unsigned entries)
+{
+    struct io_uring_params p = {0};
+
+    ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (ring->fd < 0)
+        return -errno;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        close(ring->fd);
+        return -ENOTSUP;
+    }
+
+    ring->ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    if (p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe) >
+        ring->ring_size)
+        ring->ring_size =
+            p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_ptr = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ring->fd,
+                          IORING_OFF_SQ_RING);
+    if (ring->ring_ptr == MAP_FAILED) {
+        close(ring->fd);
+        return -ENOMEM;
+    }
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        munmap(ring->ring_ptr, ring->ring_size);
+        close(ring->fd);
+        return -ENOMEM;
+    }
+
+    uint8_t *base = ring->ring_ptr;
+    ring->sq_head = (unsigned *)(base + p.sq_off.head);
+    ring->sq_tail = (unsigned *)(base + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)(base + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(base + p.sq_off.array);
+    ring->cq_head = (unsigned *)(base + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(base + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)(base + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(base + p.cq_off.cqes);
+    ring->sqe_tail = *ring->sq_tail;
+    return 0;
+}
+
+static void uring_exit(struct uring *ring)
+{
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->ring_ptr, ring->ring_size);
+    close(ring->fd);
+}
+
+/* The ring is sized so that this never runs out of entries */
+static struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+    unsigned idx = ring->sqe_tail++ & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[idx] = idx;
+    return sqe;
+}
+
+/* Submit everything queued so far, and optionally wait for completions,
+ * in a single syscall */
+static int uring_enter(struct uring *ring, unsigned wait_nr)
+{
+    unsigned submit = ring->sqe_tail - *ring->sq_tail;
+    atomic_store_explicit((_Atomic unsigned *)ring->sq_tail, ring->sqe_tail,
+                          memory_order_release);
+    if (!submit && !wait_nr)
+        return 0;
+    for (;;) {
+        int e = syscall(__NR_io_uring_enter, ring->fd, submit, wait_nr,
+                        wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (e >= 0)
+            return e;
+        if (errno != EINTR)
+            return -errno;
+    }
+}
+
+static struct io_uring_cqe *uring_peek_cqe(struct uring *ring)
+{
+    unsigned head = *ring->cq_head;
+    unsigned tail = atomic_load_explicit((_Atomic unsigned *)ring->cq_tail,
+                                         memory_order_acquire);
+    if (head == tail)
+        return NULL;
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+static void uring_cqe_seen(struct uring *ring)
+{
+    atomic_store_explicit((_Atomic unsigned *)ring->cq_head,
+                          *ring->cq_head + 1, memory_order_release);
+}
+
+enum { SLOT_IDLE, SLOT_FILLING, SLOT_INFLIGHT, SLOT_READY };
+
+struct uring_slot {
+    int state;
+    int len;  /* Bytes of data in the slot */
+    int pos;  /* Bytes consumed/written so far */
+    int res;  /* Error from a read */
+    int retries; /* -EAGAIN completions since the last progress */
+    off_t offset;
+};
+
+struct uring_chunk {
+    uint16_t bid;
+    int len;
+    int pos;
+};
+
+struct uring_stream {
+    struct uring ring;
+    int fd;
+    bool socket;
+    uint8_t *slots; /* [read 0, read 1, write 0, write 1] */
+    int error;      /* Deferred error from a background write */
+
+    struct uring_slot rd[2];
+    int rd_cur;
+    off_t rd_offset; /* Next offset to issue read-ahead for */
+    off_t rd_expect; /* Offset the caller has consumed up to */
+
+    struct uring_slot wr[2];
+    int wr_cur; /* Slot collecting writes */
+    off_t wr_offset;
+
+    struct io_uring_buf_ring *buf_ring;
+    uint8_t *recv_buffers;
+    uint16_t buf_tail;
+    struct uring_chunk chunks[URING_RECV_BUFFERS];
+    int chunk_head;
+    int chunk_count;
+    bool recv_armed;
+    bool multishot;
+    bool eof;
+};
+
+static struct uring_stream *stream_to_uring(struct stream *stream)
+{
+    return (struct uring_stream *)(stream + 1);
+}
+
+static uint8_t *uring_rd_buffer(struct uring_stream *us, int slot)
+{
+    return us->slots + slot * URING_SLOT_SIZE;
+}
+
+static uint8_t *uring_wr_buffer(struct uring_stream *us, int slot)
+{
+    return us->slots + (2 + slot) * URING_SLOT_SIZE;
+}
+
+static void uring_queue_read(struct uring_stream *us, int slot, off_t offset)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(&us->ring);
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->fd = us->fd;
+    sqe->addr = (uintptr_t)uring_rd_buffer(us, slot);
+    sqe->len = URING_SLOT_SIZE;
+    sqe->off = offset;
+    sqe->buf_index = slot;
+    sqe->user_data = URING_DATA(URING_OP_READ, slot);
+    us->rd[slot].state = SLOT_INFLIGHT;
+    us->rd[slot].offset = offset;
+}
+
+static void uring_queue_write(struct uring_stream *us, int slot)
+{
+    struct uring_slot *w = &us->wr[slot];
+    struct io_uring_sqe *sqe = uring_get_sqe(&us->ring);
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->fd = us->fd;
+    sqe->addr = (uintptr_t)uring_wr_buffer(us, slot) + w->pos;
+    sqe->len = w->len - w->pos;
+    sqe->off = us->socket ? (uint64_t)-1 : (uint64_t)(w->offset + w->pos);
+    sqe->buf_index = 2 + slot;
+    sqe->user_data = URING_DATA(URING_OP_WRITE, slot);
+    w->state = SLOT_INFLIGHT;
+}
+
+static void uring_queue_recv(struct uring_stream *us)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(&us->ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = us->fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->ioprio = us->multishot ? IORING_RECV_MULTISHOT : 0;
+    sqe->user_data = URING_DATA(URING_OP_RECV, 0);
+    us->recv_armed = true;
+}
+
+static void uring_recycle_buffer(struct uring_stream *us, uint16_t bid)
+{
+    struct io_uring_buf *buf =
+        &us->buf_ring->bufs[us->buf_tail & (URING_RECV_BUFFERS - 1)];
+    buf->addr = (uintptr_t)(us->recv_buffers + bid * URING_RECV_SIZE);
+    buf->len = URING_RECV_SIZE;
+    buf->bid = bid;
+    us->buf_tail++;
+    atomic_store_explicit((_Atomic uint16_t *)&us->buf_ring->tail,
+                          us->buf_tail, memory_order_release);
+}
+
+/* Only one write is in flight at a time, so the data reaches the file or
+ * socket in order. Start the collecting slot if nothing else is going */
+static void uring_kick_write(struct uring_stream *us)
+{
+    struct uring_slot *cur = &us->wr[us->wr_cur];
+    struct uring_slot *other = &us->wr[!us->wr_cur];
+    if (cur->state != SLOT_FILLING || other->state == SLOT_INFLIGHT)
+        return;
+    uring_queue_write(us, us->wr_cur);
+    us->wr_cur = !us->wr_cur;
+}
+
+static void uring_handle_cqe(struct uring_stream *us,
+                             const struct io_uring_cqe *cqe)
+{
+    int op = cqe->user_data >> 8;
+    int slot = cqe->user_data & 0xff;
+
+    if (op == URING_OP_READ) {
+        struct uring_slot *r = &us->rd[slot];
+        r->state = SLOT_READY;
+        r->res = cqe->res < 0 ? cqe->res : 0;
+        r->len = cqe->res < 0 ? 0 : cqe->res;
+        r->pos = 0;
+    } else if (op == URING_OP_WRITE) {
+        struct uring_slot *w = &us->wr[slot];
+        int res = cqe->res;
+        /* A write that makes no progress would otherwise be resubmitted
+         * forever */
+        if (res == 0)
+            res = -EIO;
+        else if (res == -EAGAIN && ++w->retries > URING_WRITE_RETRIES)
+            res = -EIO;
+        if (res < 0 && res != -EAGAIN) {
+            us->error = res;
+            w->state = SLOT_IDLE;
+        } else {
+            if (res > 0) {
+                w->pos += res;
+                w->retries = 0;
+            }
+            if (w->pos < w->len)
+                uring_queue_write(us, slot); /* Short write, do the rest */
+            else
+                w->state = SLOT_IDLE;
+        }
+    } else if (op == URING_OP_RECV) {
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+            us->recv_armed = false;
+        if (cqe->res == -EINVAL && us->multishot) {
+            /* Older kernel without multishot recv */
+            us->multishot = false;
+        } else if (cqe->res == 0) {
+            us->eof = true;
+        } else if (cqe->res < 0 && cqe->res != -ENOBUFS &&
+                   cqe->res != -ECANCELED) {
+            us->error = cqe->res;
+        }
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+            uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            if (cqe->res > 0) {
+                int idx = (us->chunk_head + us->chunk_count) %
+                          URING_RECV_BUFFERS;
+                us->chunks[idx].bid = bid;
+                us->chunks[idx].len = cqe->res;
+                us->chunks[idx].pos = 0;
+                us->chunk_count++;
+            } else {
+                uring_recycle_buffer(us, bid);
+            }
+        }
+    }
+}
+
+/* Process everything that has completed, without a syscall */
+static void uring_reap(struct uring_stream *us)
+{
+    struct io_uring_cqe *cqe;
+    while ((cqe = uring_peek_cqe(&us->ring)) != NULL) {
+        uring_handle_cqe(us, cqe);
+        uring_cqe_seen(&us->ring);
+    }
+    uring_kick_write(us);
+}
+
+/* Submit anything queued, wait for at least one completion & process it */
+static int uring_wait(struct uring_stream *us)
+{
+    int e = uring_enter(&us->ring, 1);
+    if (e < 0)
+        return e;
+    uring_reap(us);
+    return 0;
+}
+
+static int uring_take_error(struct uring_stream *us)
+{
+    int e = us->error;
+    us->error = 0;
+    return e;
+}
+
+static int uring_flush(struct uring_stream *us)
+{
+    uring_reap(us);
+    while (us->wr[0].state != SLOT_IDLE || us->wr[1].state != SLOT_IDLE) {
+        int e = uring_wait(us);
+        if (e < 0)
+            return e;
+    }
+    if (us->error)
+        return uring_take_error(us);
+    return 0;
+}
+
+static int uring_file_read(struct stream *stream, void *result, int max_size)
+{
+    struct uring_stream *us = stream_to_uring(stream);
+
+    for (;;) {
+        struct uring_slot *r = &us->rd[us->rd_cur];
+        if (r->state == SLOT_IDLE) {
+            /* First read: start read-ahead into both slots */
+            uring_queue_read(us, us->rd_cur, us->rd_offset);
+            uring_queue_read(us, !us->rd_cur, us->rd_offset + URING_SLOT_SIZE);
+            us->rd_offset += 2 * URING_SLOT_SIZE;
+        }
+        if (r->state == SLOT_INFLIGHT) {
+            int e = stream->nonblocking ? uring_enter(&us->ring, 0)
+                                        : uring_wait(us);
+            if (e < 0)
+                return e;
+            if (stream->nonblocking) {
+                uring_reap(us);
+                if (r->state == SLOT_INFLIGHT)
+                    return -EAGAIN;
+            }
+            continue;
+        }
+
+        if (r->offset + r->pos != us->rd_expect) {
+            /* An earlier short read left this read-ahead at the wrong
+             * offset */
+            uring_queue_read(us, us->rd_cur, us->rd_expect);
+            us->rd_offset = us->rd_expect + URING_SLOT_SIZE;
+            continue;
+        }
+        if (r->res < 0) {
+            int e = r->res;
+            r->state = SLOT_IDLE;
+            return e;
+        }
+        if (r->len == 0)
+            return 0;
+
+        int len = r->len - r->pos;
+        if (len > max_size)
+            len = max_size;
+        memcpy(result, uring_rd_buffer(us, us->rd_cur) + r->pos, len);
+        r->pos += len;
+        us->rd_expect += len;
+        if (r->pos == r->len) {
+            /* Refill this slot behind the other one. It is submitted
+             * along with the next wait */
+            uring_queue_read(us, us->rd_cur, us->rd_offset);
+            us->rd_offset += URING_SLOT_SIZE;
+            us->rd_cur = !us->rd_cur;
+        }
+        stream_notify(stream, STREAM_READABLE);
+        return len;
+    }
+}
+
+/* Make sure the collecting slot has room, waiting for the write ahead of
+ * it to finish if it is full */
+static int uring_claim_slot(struct uring_stream *us, bool wait)
+{
+    for (;;) {
+        struct uring_slot *w = &us->wr[us->wr_cur];
+        if (w->state == SLOT_IDLE) {
+            w->state = SLOT_FILLING;
+            w->len = 0;
+            w->pos = 0;
+            w->retries = 0;
+            w->offset = us->wr_offset;
+            return 0;
+        }
+        if (w->state == SLOT_FILLING && w->len < URING_SLOT_SIZE)
+            return 0;
+        if (!wait)
+            return -EAGAIN;
+        int e = uring_wait(us);
+        if (e < 0)
+            return e;
+    }
+}
+
+static int uring_copy_in(struct uring_stream *us, const void *data, int len)
+{
+    struct uring_slot *w = &us->wr[us->wr_cur];
+    if (len > URING_SLOT_SIZE - w->len)
+        len = URING_SLOT_SIZE - w->len;
+    memcpy(uring_wr_buffer(us, us->wr_cur) + w->len, data, len);
+    w->len += len;
+    us->wr_offset += len;
+    /* Send a full slot on its way, so the next copy can use the other */
+    if (w->len == URING_SLOT_SIZE)
+        uring_kick_write(us);
+    return len;
+}
+
+static int uring_write(struct stream *stream, const void *const data,
+                       const int data_len)
+{
+    struct uring_stream *us = stream_to_uring(stream);
+
+    uring_reap(us);
+    if (us->error)
+        return uring_take_error(us);
+
+    int e = uring_claim_slot(us, !stream->nonblocking);
+    if (e < 0)
+        return e;
+    int len = uring_copy_in(us, data, data_len);
+
+    uring_kick_write(us);
+    e = uring_enter(&us->ring, 0);
+    if (e < 0)
+        return e;
+
+    stream_notify(stream, STREAM_WRITABLE);
+    return len;
+}
+
+/* Gathers as much as fits into the write slots, only waiting for room
+ * before the first byte */
+static int uring_writev(struct stream *stream, const struct iovec *iov,
+                        int iovcnt)
+{
+    struct uring_stream *us = stream_to_uring(stream);
+    bool wait = !stream->nonblocking;
+    int total = 0;
+
+    uring_reap(us);
+    if (us->error)
+        return uring_take_error(us);
+
+    for (int i = 0; i < iovcnt; i++) {
+        const uint8_t *data = iov[i].iov_base;
+        size_t done = 0;
+        while (done < iov[i].iov_len) {
+            int e = uring_claim_slot(us, wait);
+            if (e < 0) {
+                if (total)
+                    goto out;
+                return e;
+            }
+            size_t left = iov[i].iov_len - done;
+            if (left > (size_t)(INT_MAX - total))
+                left = INT_MAX - total;
+            int len = uring_copy_in(us, data + done, left);
+            done += len;
+            total += len;
+            wait = false;
+            if (total == INT_MAX)
+                goto out;
+        }
+    }
+
+out:
+    uring_kick_write(us);
+    int e = uring_enter(&us->ring, 0);
+    if (e < 0)
+        return e;
+    stream_notify(stream, STREAM_WRITABLE);
+    return total;
+}
+
+/* Copy out of the queued receive buffers, across as many as fit */
+static int uring_recv_copy(struct uring_stream *us, uint8_t *result,
+                           int max_size)
+{
+    int total = 0;
+    while (us->chunk_count && total < max_size) {
+        struct uring_chunk *c = &us->chunks[us->chunk_head];
+        int len = c->len - c->pos;
+        if (len > max_size - total)
+            len = max_size - total;
+        memcpy(result + total,
+               us->recv_buffers + c->bid * URING_RECV_SIZE + c->pos, len);
+        c->pos += len;
+        total += len;
+        if (c->pos == c->len) {
+            uring_recycle_buffer(us, c->bid);
+            us->chunk_head = (us->chunk_head + 1) % URING_RECV_BUFFERS;
+            us->chunk_count--;
+        }
+    }
+    return total;
+}
+
+/* Wait for received data
+ * @return < 0 on error, 0 at end of stream, 1 once data is queued */
+static int uring_recv_wait(struct stream *stream)
+{
+    struct uring_stream *us = stream_to_uring(stream);
+
+    /* Make sure any request we've sent is actually on its way before
+     * waiting for the reply */
+    uring_reap(us);
+    int e = uring_enter(&us->ring, 0);
+    if (e < 0)
+        return e;
+
+    for (;;) {
+        if (us->chunk_count)
+            return 1;
+        if (us->error)
+            return uring_take_error(us);
+        if (us->eof)
+            return 0;
+        if (!us->recv_armed)
+            uring_queue_recv(us);
+        if (stream->nonblocking) {
+            e = uring_enter(&us->ring, 0);
+            if (e < 0)
+                return e;
+            uring_reap(us);
+            if (!us->chunk_count && !us->error && !us->eof)
+                return -EAGAIN;
+            continue;
+        }
+        e = uring_wait(us);
+        if (e < 0)
+            return e;
+    }
+}
+
+static int uring_recv(struct stream *stream, void *result, int max_size)
+{
+    int e = uring_recv_wait(stream);
+    if (e <= 0)
+        return e;
+    int len = uring_recv_copy(stream_to_uring(stream), result, max_size);
+    stream_notify(stream, STREAM_READABLE);
+    return len;
+}
+
+static int uring_recv_readv(struct stream *stream, const struct iovec *iov,
+                            int iovcnt)
+{
+    int e = uring_recv_wait(stream);
+    if (e <= 0)
+        return e;
+    int total = 0;
+    for (int i = 0; i < iovcnt && total < INT_MAX; i++) {
+        int max = iov[i].iov_len > (size_t)(INT_MAX - total)
+                      ? INT_MAX - total
+                      : (int)iov[i].iov_len;
+        int len = uring_recv_copy(stream_to_uring(stream), iov[i].iov_base,
+                                  max);
+        total += len;
+        if (len < max)
             break;
-        usleep(100 * 1000);
     }
-    // It didn't die nicely, so just hard kill it
-    if (i == 10)
-        kill(process->pid, SIGKILL);
-    waitpid(process->pid, NULL, 0);
-    close(process->fd);
+    stream_notify(stream, STREAM_READABLE);
+    return total;
+}
+
+static int uring_available(struct stream *stream, int *read, int *write)
+{
+    struct uring_stream *us = stream_to_uring(stream);
+    uring_reap(us);
+    if (read) {
+        if (!stream->read)
+            *read = 0;
+        else if (us->socket)
+            *read = us->chunk_count ? us->chunks[us->chunk_head].len -
+                                          us->chunks[us->chunk_head].pos
+                                    : us->eof;
+        else
+            *read = 1;
+    }
+    if (write)
+        *write = stream->write ? us->wr[us->wr_cur].state != SLOT_INFLIGHT
+                               : 0;
+    return us->eof && !us->chunk_count ? 0 : 1;
+}
+
+static int uring_stream_flush(struct stream *stream)
+{
+    return uring_flush(stream_to_uring(stream));
+}
+
+/* Readiness is watched on the file or socket itself. Completions are
+ * delivered as task work, which runs before poll or epoll_wait return, so
+ * by the time the descriptor reports ready the data is on the ring */
+static int uring_get_fd(struct stream *stream)
+{
+    return stream_to_uring(stream)->fd;
+}
+
+/* The descriptor is left alone, as the ring already never blocks on it.
+ * stream->nonblocking just stops reads and writes waiting for the ring */
+static int uring_set_nonblocking(struct stream *stream, bool enable)
+{
+    (void)stream;
+    (void)enable;
+    return 0;
+}
+
+static int uring_close(struct stream *stream)
+{
+    struct uring_stream *us = stream_to_uring(stream);
+    int ret = uring_flush(us);
+
+    /* Make sure the kernel is done with our buffers before freeing them */
+    if (us->recv_armed) {
+        struct io_uring_sqe *sqe = uring_get_sqe(&us->ring);
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = URING_DATA(URING_OP_RECV, 0);
+        sqe->user_data = URING_DATA(URING_OP_CANCEL, 0);
+    }
+    while (us->recv_armed || us->rd[0].state == SLOT_INFLIGHT ||
+           us->rd[1].state == SLOT_INFLIGHT)
+        if (uring_wait(us) < 0)
+            break;
+    uring_exit(&us->ring);
+    if (close(us->fd) < 0 && ret == 0)
+        ret = -errno;
+    munmap(us->slots, 4 * URING_SLOT_SIZE);
+    if (us->buf_ring)
+        munmap(us->buf_ring, URING_RECV_BUFFERS * sizeof(struct io_uring_buf));
+    free(us->recv_buffers);
+    return ret;
+}
+
+static int uring_setup_recv(struct uring_stream *us)
+{
+    us->buf_ring = mmap(NULL, URING_RECV_BUFFERS * sizeof(struct io_uring_buf),
+                        PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE,
+                        -1, 0);
+    if (us->buf_ring == MAP_FAILED) {
+        us->buf_ring = NULL;
+        return -ENOMEM;
+    }
+    us->recv_buffers = malloc(URING_RECV_BUFFERS * URING_RECV_SIZE);
+    if (!us->recv_buffers)
+        return -ENOMEM;
+
+    struct io_uring_buf_reg reg = {
+        .ring_addr = (uintptr_t)us->buf_ring,
+        .ring_entries = URING_RECV_BUFFERS,
+        .bgid = URING_BGID,
+    };
+    if (syscall(__NR_io_uring_register, us->ring.fd,
+                IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        return -errno;
+    for (int i = 0; i < URING_RECV_BUFFERS; i++)
+        uring_recycle_buffer(us, i);
+    us->multishot = true;
     return 0;
 }
 
-struct stream *stream_process_open(char *const *args)
+/* Wrap an open descriptor in an io_uring backed stream
+ * @return NULL if io_uring isn't usable, in which case fd is left open */
+static struct stream *stream_uring_open(int fd, bool socket, bool reading,
+                                        bool writing)
 {
-    pid_t pid;
-    int fd;
-
-    pid = forkpty(&fd, NULL, NULL, NULL);
+    struct stream *stream =
+        stream_alloc(sizeof(struct stream) + sizeof(struct uring_stream));
+    if (!stream)
+        return NULL;
+    struct uring_stream *us = stream_to_uring(stream);
+    us->fd = fd;
+    us->socket = socket;
 
-    if (pid < 0) {
+    if (uring_init(&us->ring, URING_ENTRIES) < 0) {
+        stream_free(stream);
         return NULL;
-    } else if (pid == 0) {
-        // This is the child process
-        execvp(args[0], args);
+    }
+    us->slots = mmap(NULL, 4 * URING_SLOT_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (us->slots == MAP_FAILED) {
+        uring_exit(&us->ring);
+        stream_free(stream);
         return NULL;
     }
 
-    struct stream *stream =
-        calloc(sizeof(struct stream) + sizeof(struct process_stream), 1);
-    if (!stream) {
-        close(fd);
-        kill(pid, SIGKILL);
+    /* Register the slots once, so the kernel doesn't have to map them for
+     * every request */
+    struct iovec iov[4];
+    for (int i = 0; i < 4; i++) {
+        iov[i].iov_base = us->slots + i * URING_SLOT_SIZE;
+        iov[i].iov_len = URING_SLOT_SIZE;
+    }
+    if (syscall(__NR_io_uring_register, us->ring.fd,
+                IORING_REGISTER_BUFFERS, iov, 4) < 0 ||
+        (socket && reading && uring_setup_recv(us) < 0)) {
+        us->fd = -1;
+        uring_close(stream);
+        stream_free(stream);
         return NULL;
     }
-    struct process_stream *process = stream_to_process(stream);
-    process->pid = pid;
-    process->fd = fd;
-    stream->write = process_write;
-    stream->read = process_read;
-    stream->close = process_close;
-    stream->available = NULL; // TODO: Implement available + notify
+
+    if (socket && reading) {
+        /* Start receiving straight away */
+        uring_queue_recv(us);
+        uring_enter(&us->ring, 0);
+    }
+
+    if (reading) {
+        stream->read = socket ? uring_recv : uring_file_read;
+        if (socket)
+            stream->readv = uring_recv_readv;
+    }
+    if (writing) {
+        stream->write = uring_write;
+        stream->writev = uring_writev;
+    }
+    stream->available = uring_available;
+    stream->flush = uring_stream_flush;
+    stream->get_fd = uring_get_fd;
+    stream->set_nonblocking = uring_set_nonblocking;
+    stream->close = uring_close;
     return stream;
 }
+#endif
 
-struct tcp_stream {
-    int fd;
-};
+bool stream_uses_uring(struct stream *stream)
+{
+#ifdef __linux__
+    return stream && stream->close == uring_close;
+#else
+    (void)stream;
+    return false;
+#endif
+}
 
-struct tcp_stream *stream_to_tcp(struct stream *stream)
+/*******
+ * WAITING
+ *******/
+/* Number of readiness checks made before sleeping, with STREAM_WAIT_SPIN */
+#define STREAM_WAIT_SPINS 1000
+
+static inline void cpu_relax(void)
 {
-    return (struct tcp_stream *)(stream + 1);
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_pause();
+#elif defined(__aarch64__)
+    __asm__ volatile("yield");
+#endif
 }
 
-static int tcp_read(struct stream *stream, void *result, int max_size)
+/* Every notification moves the sequence on, so a waiter which read the
+ * old value either sees the change before sleeping or is woken by it */
+static void stream_wake(struct stream *stream)
 {
-    struct tcp_stream *tcp = stream_to_tcp(stream);
+    atomic_fetch_add(&stream->wait.seq, 1);
+    if (stream->shared_wait)
+        atomic_fetch_add(&stream->shared_wait->seq, 1);
+#ifdef __linux__
+    int wake_fd = atomic_load(&stream->polled) ? atomic_load(&stream->wake_fd)
+                                               : 0;
+    if (wake_fd) {
+        uint64_t one = 1;
+        if (write(wake_fd - 1, &one, sizeof(one)) < 0) {
+            /* The counter is already non-zero, which is all that matters */
+        }
+    }
+    if (atomic_load(&stream->wait.waiters))
+        syscall(SYS_futex, &stream->wait.seq, FUTEX_WAKE_PRIVATE, INT_MAX,
+                NULL, NULL, 0);
+    if (stream->shared_wait && atomic_load(&stream->shared_wait->waiters))
+        syscall(SYS_futex, &stream->shared_wait->seq, FUTEX_WAKE, INT_MAX,
+                NULL, NULL, 0);
+#endif
+}
 
-    int n = recv(tcp->fd, result, max_size, 0);
-    if (n < 0)
-        return -errno;
+/* Find the descriptor backed stream at the bottom of a stack of layered
+ * streams, if there is one */
+static struct stream *stream_root(struct stream *stream)
+{
+    while (!stream->get_fd && stream->parent)
+        stream = stream->parent;
+    return stream->get_fd ? stream : NULL;
+}
 
-    check_notify_fd(stream, tcp->fd);
+static short stream_poll_events(int events)
+{
+    return ((events & STREAM_READABLE) ? POLLIN : 0) |
+           ((events & STREAM_WRITABLE) ? POLLOUT : 0);
+}
 
-    return n;
+static int stream_ready_events(struct stream *stream)
+{
+    bool readable, writable;
+    int e = stream_ready(stream, &readable, &writable);
+    if (e < 0)
+        return e;
+    return (readable ? STREAM_READABLE : 0) |
+           (writable ? STREAM_WRITABLE : 0) | (e == 0 ? STREAM_HANGUP : 0);
 }
 
-static int tcp_available(struct stream *stream, int *read, int *write)
+/* Bounds on the nap taken while a descriptor signals a level that the
+ * stream still isn't ready at (a watermark, or a layered stream) */
+#define STREAM_NAP_MIN_NS (50 * 1000)
+#define STREAM_NAP_MAX_NS (10 * 1000 * 1000)
+
+static struct timespec *ns_to_timespec(int64_t ns, struct timespec *ts)
 {
-    (void)stream;
-    // TODO: Actually detect if we can read/write
-    if (read)
-        *read = 1;
-    if (write)
-        *write = 1;
-    return 1;
+    if (ns < 0)
+        return NULL;
+    ts->tv_sec = ns / 1000000000;
+    ts->tv_nsec = ns % 1000000000;
+    return ts;
 }
 
-static int tcp_write(struct stream *stream, const void *const data,
-                     const int data_len)
+/* Drop from each pollfd the directions its descriptor already signals.
+ * The stream behind it wasn't ready, so polling for those again would
+ * return straight away. Returns whether any were dropped */
+static bool poll_drop_asserted(struct pollfd *pfds, int n)
 {
-    struct tcp_stream *tcp = stream_to_tcp(stream);
+    struct timespec zero = {0};
+    bool dropped = false;
 
-    int n = send(tcp->fd, data, data_len, 0);
-    if (n < 0)
-        return -errno;
-    check_notify_fd(stream, tcp->fd);
-    return n;
+    if (ppoll(pfds, n, &zero, NULL) <= 0)
+        return false;
+    for (int i = 0; i < n; i++) {
+        short asserted = pfds[i].revents & pfds[i].events;
+        pfds[i].events &= ~asserted;
+        dropped |= asserted != 0;
+    }
+    return dropped;
 }
 
-static int tcp_close(struct stream *stream)
+/* Cap 'timeout_ns' at the current nap, and double the nap for next time */
+static int64_t stream_nap(int64_t timeout_ns, int64_t *nap_ns)
 {
-    struct tcp_stream *tcp = stream_to_tcp(stream);
-    if (close(tcp->fd) < 0)
+    int64_t nap = *nap_ns;
+    if (*nap_ns < STREAM_NAP_MAX_NS)
+        *nap_ns *= 2;
+    return timeout_ns < 0 || timeout_ns > nap ? nap : timeout_ns;
+}
+
+/* Sleep until the stream might have changed, or 'timeout_ns' passes (< 0
+ * for no limit). Descriptor streams, and those layered on them, sleep in
+ * poll; in-memory streams sleep on their notification sequence. While
+ * the descriptor signals a level that isn't enough for the stream, naps
+ * on the sequence grow from '*nap_ns' instead of polling it again */
+static int stream_park(struct stream *stream, int events,
+                       struct stream_waitq *wait, uint32_t seq,
+                       int64_t timeout_ns, int64_t *nap_ns)
+{
+    struct timespec ts;
+    struct stream *root = stream_root(stream);
+
+    if (root) {
+        int fd = root->get_fd(root);
+        if (fd < 0)
+            return fd;
+        struct pollfd pfd = {.fd = fd, .events = stream_poll_events(events)};
+        if (!poll_drop_asserted(&pfd, 1))
+            *nap_ns = STREAM_NAP_MIN_NS;
+        else
+            timeout_ns = stream_nap(timeout_ns, nap_ns);
+        if (pfd.events) {
+            if (ppoll(&pfd, 1, ns_to_timespec(timeout_ns, &ts), NULL) < 0 &&
+                errno != EINTR)
+                return -errno;
+            return 0;
+        }
+    }
+    struct timespec *tp = ns_to_timespec(timeout_ns, &ts);
+#ifdef __linux__
+    int op = wait == stream->shared_wait ? FUTEX_WAIT : FUTEX_WAIT_PRIVATE;
+    if (syscall(SYS_futex, &wait->seq, op, seq, tp, NULL, 0) < 0 &&
+        errno != EAGAIN && errno != EINTR && errno != ETIMEDOUT)
         return -errno;
+#else
+    (void)wait;
+    (void)seq;
+    /* Without futexes, fall back to checking periodically */
+    struct timespec nap = {.tv_nsec = 100000};
+    if (tp && timeout_ns < nap.tv_nsec)
+        nap = ts;
+    nanosleep(&nap, NULL);
+#endif
     return 0;
 }
 
-struct stream *stream_tcp_open(const char *host, int port)
+int stream_wait(struct stream *stream, int events, int64_t timeout_ns)
 {
-    int sockfd;
-    struct hostent *he;
-    struct sockaddr_in addr = {};
-    int enable = 1;
+    if (!stream || !(events & (STREAM_READABLE | STREAM_WRITABLE)))
+        return -EINVAL;
+    int wanted = (events & (STREAM_READABLE | STREAM_WRITABLE)) |
+                 STREAM_HANGUP;
+    int spins = (events & STREAM_WAIT_SPIN) ? STREAM_WAIT_SPINS : 0;
+    uint64_t deadline = timeout_ns < 0 ? 0 : stream_now_ns() + timeout_ns;
+    struct stream_waitq *wait =
+        stream->shared_wait ? stream->shared_wait : &stream->wait;
+    int64_t nap = STREAM_NAP_MIN_NS;
+    int ret;
 
-    he = gethostbyname(host);
-    if (!he) {
-        perror("gethostbyname");
-        return NULL;
+    atomic_fetch_add(&wait->waiters, 1);
+    for (;;) {
+        uint32_t seq = atomic_load(&wait->seq);
+        ret = stream_ready_events(stream);
+        if (ret < 0 || (ret & wanted))
+            break;
+
+        int64_t remaining = -1;
+        if (timeout_ns >= 0) {
+            uint64_t now = stream_now_ns();
+            if (now >= deadline) {
+                ret = 0;
+                break;
+            }
+            remaining = deadline - now;
+        }
+        if (spins > 0) {
+            spins--;
+            cpu_relax();
+            continue;
+        }
+        ret = stream_park(stream, events, wait, seq, remaining, &nap);
+        if (ret < 0)
+            break;
     }
+    atomic_fetch_sub(&wait->waiters, 1);
+    return ret < 0 ? ret : ret & wanted;
+}
 
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0) {
-        perror("socket");
-        return NULL;
+/* How often stream_poll re-checks streams shared with another process,
+ * whose notifications can't reach its eventfd */
+#define STREAM_POLL_SHARED_NS (1000 * 1000)
+
+/* Up to this many streams are polled without allocating */
+#define STREAM_POLL_LOCAL 16
+
+#ifdef __linux__
+/* The eventfd a stream's notifications signal while it is polled. Only
+ * the one stream_poll watching the stream calls this */
+static int stream_wake_fd(struct stream *stream)
+{
+    int fd = atomic_load(&stream->wake_fd);
+    if (fd)
+        return fd - 1;
+    fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (fd < 0)
+        return -errno;
+    atomic_store(&stream->wake_fd, fd + 1);
+    return fd;
+}
+#endif
+
+/* Descriptor streams (and those layered on them) are watched directly.
+ * The rest are watched through their own eventfd, which every
+ * notification signals while they are being polled */
+int stream_poll(struct stream **streams, int n, const short *events,
+                short *revents, int64_t timeout_ns)
+{
+    if (!streams || n <= 0 || !events || !revents)
+        return -EINVAL;
+    for (int i = 0; i < n; i++)
+        if (!streams[i])
+            return -EINVAL;
+#ifdef __linux__
+    uint64_t deadline = timeout_ns < 0 ? 0 : stream_now_ns() + timeout_ns;
+    int64_t nap = STREAM_NAP_MIN_NS;
+    int ready = 0;
+    int registered = 0;
+    bool shared = false;
+
+    struct pollfd local[STREAM_POLL_LOCAL];
+    struct pollfd *pfds =
+        n <= STREAM_POLL_LOCAL ? local : stream_alloc(sizeof(*pfds) * n);
+    if (!pfds)
+        return -ENOMEM;
+
+    for (; registered < n; registered++) {
+        struct stream *stream = streams[registered];
+        struct stream *root = stream_root(stream);
+
+        /* A second poller would steal this one's wakeups */
+        if (atomic_exchange(&stream->polled, true)) {
+            ready = -EBUSY;
+            goto out;
+        }
+        int fd = root ? root->get_fd(root) : stream_wake_fd(stream);
+        if (fd < 0) {
+            atomic_store(&stream->polled, false);
+            ready = fd;
+            goto out;
+        }
+        pfds[registered].fd = fd;
+        shared |= stream->shared_wait != NULL;
     }
 
-    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) <
-        0)
-        perror("SO_REUSEADDR");
+    for (;;) {
+        for (int i = 0; i < n; i++) {
+            int e = stream_ready_events(streams[i]);
+            if (e < 0) {
+                ready = e;
+                goto out;
+            }
+            revents[i] = e & (events[i] | STREAM_HANGUP);
+            if (revents[i])
+                ready++;
+        }
+        if (ready)
+            break;
 
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-    addr.sin_addr = *((struct in_addr *)he->h_addr);
+        struct timespec ts;
+        int64_t remaining = -1;
+        if (timeout_ns >= 0) {
+            uint64_t now = stream_now_ns();
+            if (now >= deadline)
+                break;
+            remaining = deadline - now;
+        }
+        if (shared && (remaining < 0 || remaining > STREAM_POLL_SHARED_NS))
+            remaining = STREAM_POLL_SHARED_NS;
+        /* None of the streams were ready, so any descriptor level already
+         * signalled is one they need more than; nap rather than spin. A
+         * signalled eventfd is a fresh notification, so stays in */
+        for (int i = 0; i < n; i++)
+            pfds[i].events = stream_poll_events(events[i]);
+        if (poll_drop_asserted(pfds, n))
+            remaining = stream_nap(remaining, &nap);
+        else
+            nap = STREAM_NAP_MIN_NS;
+        for (int i = 0; i < n; i++)
+            if (!stream_root(streams[i]))
+                pfds[i].events = POLLIN;
+        if (ppoll(pfds, n, ns_to_timespec(remaining, &ts), NULL) < 0 &&
+            errno != EINTR) {
+            ready = -errno;
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            uint64_t count;
+            if (!stream_root(streams[i]) && (pfds[i].revents & POLLIN) &&
+                read(pfds[i].fd, &count, sizeof(count)) < 0) {
+                /* Already reset, which is all that matters */
+            }
+        }
+    }
 
-    if (connect(sockfd, (struct sockaddr *)&addr, sizeof(struct sockaddr)) ==
-        -1) {
-        perror("connect");
-        close(sockfd);
+out:
+    for (int i = 0; i < registered; i++)
+        atomic_store(&streams[i]->polled, false);
+    if (pfds != local)
+        stream_free(pfds);
+    return ready;
+#else
+    (void)timeout_ns;
+    return -ENOTSUP;
+#endif
+}
+
+/*******
+ * EVENT LOOP
+ *******/
+#define STREAM_LOOP_EVENTS 64
+
+struct stream_loop {
+    int epoll_fd;
+    /* Streams currently in the loop, so they can be detached on close */
+    struct stream *members;
+};
+
+struct stream_loop *stream_loop_open(void)
+{
+#ifdef __linux__
+    struct stream_loop *loop = stream_alloc(sizeof(struct stream_loop));
+    if (!loop)
+        return NULL;
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd < 0) {
+        stream_free(loop);
         return NULL;
     }
+    return loop;
+#else
+    return NULL;
+#endif
+}
 
-    struct stream *stream =
-        calloc(sizeof(struct stream) + sizeof(struct tcp_stream), 1);
-    struct tcp_stream *tcp = stream_to_tcp(stream);
-    tcp->fd = sockfd;
+int stream_loop_add(struct stream_loop *loop, struct stream *stream)
+{
+    if (!loop || !stream || stream->loop)
+        return -EINVAL;
+    if (!stream->get_fd)
+        return -ENOTSUP;
+#ifdef __linux__
+    int fd = stream->get_fd(stream);
+    if (fd < 0)
+        return fd;
+    /* Edge triggered, so each stream is only reported when it becomes
+     * ready, rather than on every pass while it stays ready */
+    struct epoll_event ev = {
+        .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+        .data.ptr = stream,
+    };
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        return -errno;
+    stream->loop = loop;
+    stream->loop_prev = NULL;
+    stream->loop_next = loop->members;
+    if (loop->members)
+        loop->members->loop_prev = stream;
+    loop->members = stream;
+    return 0;
+#else
+    return -ENOTSUP;
+#endif
+}
 
-    stream->read = tcp_read;
-    stream->write = tcp_write;
-    stream->available = tcp_available;
-    stream->close = tcp_close;
+int stream_loop_remove(struct stream_loop *loop, struct stream *stream)
+{
+    if (!loop || !stream || stream->loop != loop)
+        return -EINVAL;
+#ifdef __linux__
+    int fd = stream->get_fd(stream);
+    if (stream->loop_prev)
+        stream->loop_prev->loop_next = stream->loop_next;
+    else
+        loop->members = stream->loop_next;
+    if (stream->loop_next)
+        stream->loop_next->loop_prev = stream->loop_prev;
+    stream->loop = NULL;
+    stream->loop_prev = stream->loop_next = NULL;
+    if (fd < 0)
+        return fd;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL) < 0)
+        return -errno;
+    return 0;
+#else
+    return -ENOTSUP;
+#endif
+}
 
-    return stream;
+int stream_loop_run(struct stream_loop *loop, int timeout_ms)
+{
+    if (!loop)
+        return -EINVAL;
+#ifdef __linux__
+    struct epoll_event events[STREAM_LOOP_EVENTS];
+    int n = epoll_wait(loop->epoll_fd, events, STREAM_LOOP_EVENTS,
+                       timeout_ms);
+    if (n < 0)
+        return errno == EINTR ? 0 : -errno;
+    /* epoll is already edge triggered, so its events go straight to the
+     * per-direction callbacks */
+    for (int i = 0; i < n; i++) {
+        struct stream *stream = events[i].data.ptr;
+        uint32_t ev = events[i].events;
+        bool readable = ev & (EPOLLIN | EPOLLRDHUP | EPOLLHUP);
+        bool writable = ev & EPOLLOUT;
+        stream_notify_level(stream, (readable ? STREAM_READABLE : 0) |
+                                        (writable ? STREAM_WRITABLE : 0));
+        /* Watermarks need the actual counts, rather than just the event */
+        if ((stream->read_lowat || stream->write_lowat) &&
+            stream_ready(stream, &readable, &writable) < 0)
+            continue;
+        if (readable)
+            stream_notify_read(stream);
+        if (writable)
+            stream_notify_write(stream);
+    }
+    return n;
+#else
+    (void)timeout_ms;
+    return -ENOTSUP;
+#endif
+}
+
+int stream_loop_close(struct stream_loop *loop)
+{
+    if (!loop)
+        return -EINVAL;
+    /* Detach any remaining members, so they don't refer to the freed loop
+     * and go back to checking readiness themselves */
+    for (struct stream *stream = loop->members, *next; stream;
+         stream = next) {
+        next = stream->loop_next;
+        stream->loop = NULL;
+        stream->loop_prev = stream->loop_next = NULL;
+    }
+    close(loop->epoll_fd);
+    stream_free(loop);
+    return 0;
 }
 
 /*******
  * UTILITY FUNCTIONS
  *******/
+#define STREAM_COPY_SIZE (64 * 1024)
+#define STREAM_SPLICE_SIZE (1024 * 1024)
+
+#ifdef __linux__
+/* Data already taken from the input has nowhere else to go, so a full
+ * (non-blocking) output is waited out rather than given up on */
+static int wait_writable(int fd)
+{
+    struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+    if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+        return -errno;
+    return 0;
+}
+
+/* Write out whatever is left in the intermediate splice pipe when the
+ * output refuses to be spliced to */
+static ssize_t drain_pipe_fd(int pipe_fd, int out_fd, size_t len)
+{
+    uint8_t buffer[4096];
+    ssize_t copied = 0;
+    while ((size_t)copied < len) {
+        ssize_t r = read(pipe_fd, buffer, sizeof(buffer));
+        if (r <= 0)
+            return r < 0 ? -errno : copied;
+        for (ssize_t w = 0; w < r;) {
+            ssize_t t = write(out_fd, &buffer[w], r - w);
+            if (t < 0 && errno == EAGAIN)
+                t = wait_writable(out_fd);
+            else if (t < 0 && errno == EINTR)
+                t = 0;
+            else if (t < 0)
+                t = -errno;
+            if (t < 0)
+                return copied + w ? copied + w : t;
+            w += t;
+        }
+        copied += r;
+    }
+    return copied;
+}
+
+/* Move data from in_fd to out_fd via an intermediate pipe, so neither end
+ * needs to be a pipe itself. Once anything has been copied, an error is
+ * reported as a short count, so the caller can carry on from there */
+static ssize_t splice_fds(int in_fd, int out_fd)
+{
+    int p[2];
+    ssize_t copied = 0;
+
+    if (pipe2(p, O_CLOEXEC) < 0)
+        return -errno;
+    for (;;) {
+        ssize_t r = splice(in_fd, NULL, p[1], NULL, STREAM_SPLICE_SIZE,
+                           SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (r < 0) {
+            r = -errno;
+            if (copied == 0 && (r == -EINVAL || r == -ENOSYS))
+                r = -ENOTSUP;
+            if (copied == 0)
+                copied = r;
+            break;
+        }
+        if (r == 0)
+            break;
+        ssize_t w = 0, t = 0;
+        while (w < r) {
+            t = splice(p[0], NULL, out_fd, NULL, r - w,
+                       SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (t < 0 && (errno == EINVAL || errno == ENOSYS))
+                t = drain_pipe_fd(p[0], out_fd, r - w);
+            else if (t < 0 && errno == EAGAIN)
+                t = wait_writable(out_fd);
+            else if (t < 0 && errno == EINTR)
+                t = 0;
+            else if (t < 0)
+                t = -errno;
+            if (t < 0)
+                break;
+            w += t;
+        }
+        copied += w;
+        if (w < r) {
+            /* The output failed, with the rest already out of the input */
+            if (copied == 0)
+                copied = t < 0 ? t : -EIO;
+            break;
+        }
+    }
+    close(p[0]);
+    close(p[1]);
+    return copied;
+}
+
+/* Copy between two descriptors without bouncing the data through user
+ * space. Tries copy_file_range between regular files, then sendfile from a
+ * regular file, then splice
+ * @return -ENOTSUP if none of these apply and nothing has been copied, else
+ * < 0 on failure with nothing copied, number of bytes copied otherwise
+ */
+static ssize_t copy_fds(int in_fd, int out_fd)
+{
+    struct stat in_st, out_st;
+    ssize_t copied = 0;
+    ssize_t e = 0;
+
+    if (fstat(in_fd, &in_st) < 0 || fstat(out_fd, &out_st) < 0)
+        return -errno;
+
+    if (S_ISREG(in_st.st_mode) && S_ISREG(out_st.st_mode)) {
+        while ((e = copy_file_range(in_fd, NULL, out_fd, NULL,
+                                    STREAM_SPLICE_SIZE, 0)) > 0)
+            copied += e;
+        if (e == 0 || copied)
+            return copied;
+        if (errno != EXDEV && errno != EINVAL && errno != ENOSYS &&
+            errno != EOPNOTSUPP)
+            return -errno;
+    }
+
+    if (S_ISREG(in_st.st_mode)) {
+        while ((e = sendfile(out_fd, in_fd, NULL, STREAM_SPLICE_SIZE)) > 0)
+            copied += e;
+        if (e == 0 || copied)
+            return copied;
+        if (errno != EINVAL && errno != ENOSYS)
+            return -errno;
+    }
+
+    return splice_fds(in_fd, out_fd);
+}
+#endif
+
 int stream_copy(struct stream *input_stream, struct stream *output_stream)
 {
-    uint8_t buffer[1024];
-    int copied = 0;
+    ssize_t copied = stream_copy64(input_stream, output_stream);
+    return copied > INT_MAX ? INT_MAX : copied;
+}
+
+ssize_t stream_copy64(struct stream *input_stream,
+                      struct stream *output_stream)
+{
+    uint8_t *buffer;
+    ssize_t copied = 0;
     bool done = false;
 
+#ifdef __linux__
+    /* Let the kernel move the data when both ends are descriptors, and
+     * nothing has been read ahead into a peek buffer or an io_uring ring */
+    if (input_stream && output_stream && input_stream->read &&
+        output_stream->write && input_stream->get_fd &&
+        output_stream->get_fd &&
+        input_stream->peek_pos >= input_stream->peek_len &&
+        !stream_uses_uring(input_stream) &&
+        !stream_uses_uring(output_stream)) {
+        int in_fd = input_stream->get_fd(input_stream);
+        int out_fd = output_stream->get_fd(output_stream);
+        if (in_fd < 0)
+            return in_fd;
+        if (out_fd < 0)
+            return out_fd;
+        uint64_t start =
+            input_stream->stats || output_stream->stats ? stream_now_ns() : 0;
+        ssize_t e = copy_fds(in_fd, out_fd);
+        if (e != -ENOTSUP) {
+            /* The whole transfer counts as one read and one write */
+            if (input_stream->stats)
+                stats_record(input_stream, true, e > 0 ? e : 0, e, start);
+            if (output_stream->stats)
+                stats_record(output_stream, false, e > 0 ? e : 0, e, start);
+            /* Both ends moved, as if read and written */
+            stream_notify(input_stream, STREAM_READABLE);
+            stream_notify(output_stream, STREAM_WRITABLE);
+            return e;
+        }
+    }
+#endif
+
+    buffer = malloc(STREAM_COPY_SIZE);
+    if (!buffer)
+        return -ENOMEM;
+
     while (!done) {
-        int r = stream_read(input_stream, buffer, sizeof(buffer));
-        if (r < 0)
-            return r;
+        int r = stream_read(input_stream, buffer, STREAM_COPY_SIZE);
+        if (r < 0) {
+            copied = r;
+            break;
+        }
         if (r == 0)
             done = true;
 
         int w = 0;
         while (w < r) {
             int t = stream_write(output_stream, &buffer[w], r - w);
-            if (t < 0)
-                return t;
+            if (t < 0) {
+                copied = t;
+                done = true;
+                break;
+            }
             if (t == 0) {
                 done = true;
                 break;
             }
             w += t;
         }
-        copied += w;
+        if (copied >= 0)
+            copied += w;
     }
 
+    free(buffer);
     return copied;
 }
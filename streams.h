@@ -2,22 +2,71 @@
 #define STREAMS_H
 
 #include <pthread.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 struct stream;
 
+/**
+ * Replace the functions used to allocate & free all stream memory.
+ * Allocations must be aligned suitably for any type, as with malloc.
+ * Passing NULL restores malloc/free. This must not be changed while any
+ * streams are open
+ */
+void stream_set_allocator(void *(*alloc)(size_t size),
+                          void (*release)(void *ptr));
+
 /**
  * Open a file on the local filesystem as a stream
  * @param file_name local file name
  * @param mode Mode to open the file in, ie: "w", "r", "wr"
+ * Adding 'u' to a read-only or write-only mode (ie: "ru") uses io_uring
+ * with read-ahead and write-behind where the system supports it (see
+ * stream_uses_uring). Non-blocking reads then return -EAGAIN while the
+ * read-ahead is still in flight.
+ * Adding 'm' to a read-only mode ("rm") maps the file into memory instead,
+ * which also allows stream_available/stream_peek to see the whole file.
+ * Files that can't be mapped, such as pipes and devices, are read through
+ * stdio as with plain "r"
  * @return NULL on failure, stream handle on success
  */
 struct stream *stream_file_open(const char *file_name, const char *mode);
 struct stream *stream_mem_open(void *memory_area, size_t memory_len,
                                const char *mode);
+
+/**
+ * Check whether a stream asked to use io_uring (the 'u' file mode or
+ * STREAM_TCP_IO_URING) got it, as both quietly fall back to plain system
+ * calls where io_uring isn't available
+ */
+bool stream_uses_uring(struct stream *stream);
+
+/**
+ * The stream_*_init functions build a stream in caller supplied storage
+ * (ie: on the stack, or in an arena) instead of allocating it. The storage
+ * must be aligned suitably for any type, at least as big as the matching
+ * stream_*_storage_size, and must outlive the stream. stream_close must
+ * still be called, but won't free the storage.
+ * @return NULL on failure, stream handle (at the start of storage) on
+ * success
+ */
+size_t stream_mem_storage_size(void);
+struct stream *stream_mem_init(void *storage, size_t storage_len,
+                               void *memory_area, size_t memory_len,
+                               const char *mode);
 struct stream *stream_url_open(const char *url, const char *mode);
+/**
+ * Open a read-only stream of pseudo-random bytes, ending after 'max_len'
+ * bytes (or never, if < 0). Each stream has its own generator, so streams
+ * can be used from different threads. stream_rand_open seeds it
+ * differently each time, stream_rand_open_seeded gives the same output
+ * for the same 'seed', regardless of how the reads are sized
+ */
 struct stream *stream_rand_open(int max_len);
+struct stream *stream_rand_open_seeded(int max_len, uint64_t seed);
 
 /**
  * Open a command and read/write from it
@@ -29,26 +78,246 @@ struct stream *stream_process_open(char *const *args);
  */
 struct stream *stream_tcp_open(const char *host, int port);
 
+/* Flags for stream_tcp_open_ex and stream_tcp_listen */
+/* Use io_uring (where available) with multishot receive and write-behind.
+ * The stream still supports stream_wait, stream_poll, stream_loop and
+ * non-blocking mode, which watch the socket itself */
+#define STREAM_TCP_IO_URING 0x01
+/* Allow several listeners (typically one per thread) to bind the same
+ * port, each with its own accept queue */
+#define STREAM_TCP_REUSEPORT 0x02
+
+/**
+ * Open a read/write tcp stream connection to a host:port, with a
+ * combination of the STREAM_TCP_* flags
+ */
+struct stream *stream_tcp_open_ex(const char *host, int port, int flags);
+
+/**
+ * Listen for tcp connections on host:port ('host' may be NULL for all
+ * interfaces). The listener can't be read or written, but reports pending
+ * connections through stream_available and notifications, and can be
+ * made non-blocking or added to a stream_loop
+ */
+struct stream *stream_tcp_listen(const char *host, int port, int backlog,
+                                 int flags);
+
+/**
+ * Accept the next connection on a listener created by stream_tcp_listen,
+ * using the listener's flags
+ * @return NULL on failure (errno is EAGAIN if a non-blocking listener has
+ * nothing waiting), tcp stream on success
+ */
+struct stream *stream_tcp_accept(struct stream *listener);
+
+/**
+ * Open one end of a ring buffer in shared memory, for moving data between
+ * processes without going through the kernel. 'name' is a POSIX shared
+ * memory name ("/something"). The first end to open it creates a ring of
+ * 'size' bytes; the other end attaches to it (its 'size' is ignored).
+ * 'mode' is "r" or "w": one process reads and the other writes. Reads and
+ * writes never block, as with stream_pipe_open; use stream_wait to sleep
+ * until the other process makes progress. Once the writer closes and the
+ * ring is drained, the reader's stream_available returns 0. Once the
+ * reader closes, the writer's stream_available returns 0 and writes fail
+ * with -EPIPE. Opening an end that is already open fails with EBUSY.
+ * Notify callbacks only see this process's own reads and writes
+ */
+struct stream *stream_shm_open(const char *name, int size, const char *mode);
+
+/**
+ * Open a read/write unix domain socket stream connection to 'path'
+ */
+struct stream *stream_unix_open(const char *path);
+
+/* Flags for stream_unix_open_ex and stream_unix_listen. These don't
+ * overlap the STREAM_TCP_* flags, which may also be given */
+/* Use SOCK_SEQPACKET, so each write is received by exactly one read.
+ * A read too small for the packet fails with -EMSGSIZE and the packet
+ * is discarded */
+#define STREAM_UNIX_SEQPACKET 0x04
+
+/**
+ * Open a unix domain socket stream connection to 'path', with a
+ * combination of the STREAM_UNIX_* flags
+ */
+struct stream *stream_unix_open_ex(const char *path, int flags);
+
+/**
+ * Listen for unix domain socket connections on 'path', which must not
+ * already exist. The socket file is removed when the listener is closed.
+ * Otherwise behaves as stream_tcp_listen
+ */
+struct stream *stream_unix_listen(const char *path, int backlog, int flags);
+
+/**
+ * Accept the next connection on a listener created by stream_unix_listen
+ * @return NULL on failure, unix socket stream on success
+ */
+struct stream *stream_unix_accept(struct stream *listener);
+
+/* Most descriptors that can be passed in one stream_unix_send_fds call */
+#define STREAM_UNIX_MAX_FDS 16
+
+/**
+ * Write 'len' (at least 1) bytes of 'data' to a unix socket stream, passing
+ * copies of the 'nfds' descriptors in 'fds' along with them (SCM_RIGHTS)
+ * @return < 0 on failure, number of bytes written on success
+ */
+int stream_unix_send_fds(struct stream *stream, const void *data, int len,
+                         const int *fds, int nfds);
+
+/**
+ * Read from a unix socket stream, collecting any descriptors passed
+ * alongside the data. On entry '*nfds' is the room in 'fds', on return
+ * it is the number received. Any beyond the room available are closed,
+ * as are all of them when a packet is truncated (-EMSGSIZE)
+ * @return < 0 on failure, number of bytes read on success
+ */
+int stream_unix_recv_fds(struct stream *stream, void *data, int max_size,
+                         int *fds, int *nfds);
+
 /**
  * Create a stream which sends data from writes out to reads
  */
 struct stream *stream_pipe_open(int buffer_size);
+size_t stream_pipe_storage_size(int buffer_size);
+struct stream *stream_pipe_init(void *storage, size_t storage_len,
+                                int buffer_size);
+
+/**
+ * Create a pipe stream which is safe to use without locking when exactly
+ * one thread writes to it and exactly one other thread reads from it
+ */
+struct stream *stream_pipe_spsc_open(int buffer_size);
 
 /**
  * Convert a byte-wise reader into a line-wise one
  */
 struct stream *stream_line_open(struct stream *input);
 
+/**
+ * Convert a byte-wise reader into a line-wise one, with control over the
+ * line buffer
+ * @param initial_size Initial size of the line buffer, it grows as needed
+ * @param max_line Lines longer than this are split into several lines
+ */
+struct stream *stream_line_open_ex(struct stream *input, int initial_size,
+                                   int max_line);
+
+/**
+ * The initial line buffer is part of the storage, so no allocation is
+ * needed unless a line outgrows it
+ */
+size_t stream_line_storage_size(int initial_size);
+struct stream *stream_line_init(void *storage, size_t storage_len,
+                                struct stream *input, int initial_size,
+                                int max_line);
+
+/**
+ * Get the next line from a line stream without copying it
+ * @param line Set to the start of the line, which is not nul terminated.
+ * It is only valid until the next operation on the stream
+ * @param len Set to the length of the line, excluding its terminator
+ * @return < 0 on failure, 0 if no complete line is available yet, 1 if a
+ * line was returned
+ */
+int stream_line_next(struct stream *stream, const char **line, int *len);
+
+/**
+ * Add read-ahead and write coalescing on top of another stream.
+ * Reads are served from a buffer of 'read_size' bytes, filled with one
+ * read of the parent at a time. Writes are collected until 'write_size'
+ * bytes are waiting, stream_flush is called, or a read needs more data.
+ * Reads or writes larger than the buffers go straight to the parent.
+ * A size of 0 disables buffering in that direction.
+ */
+struct stream *stream_buffered_open(struct stream *parent, int read_size,
+                                    int write_size);
+
+/**
+ * Push any data the stream is holding on to out to its destination
+ * @return < 0 on failure, 0 on success
+ */
+int stream_flush(struct stream *stream);
+
+/**
+ * Switch a descriptor backed stream (tcp or process) in or out of
+ * non-blocking mode. While non-blocking, stream_read and stream_write
+ * return -EAGAIN instead of waiting, and stream_available reports whether
+ * each direction is ready right now
+ * @return < 0 on failure (-EOPNOTSUPP if the stream has no descriptor),
+ * 0 on success
+ */
+int stream_set_nonblocking(struct stream *stream, bool enable);
+
 /**
  * Sets a callback function + userdata to be called whenever this stream
  * has data availe for either read or write (use stream_available to check
  * which)
- * TODO: Distinguish between read/write availability?
  */
 int stream_set_notify(struct stream *stream,
                       void (*)(void *data, struct stream *stream),
                       void *data);
 
+/**
+ * Sets separate callbacks for the stream becoming readable and becoming
+ * writable. These are edge triggered: each fires only when its direction
+ * goes from not ready to ready, not on every operation. The first check
+ * after registering reports whatever is ready at that point. Either
+ * callback may be NULL, and these can be used alongside stream_set_notify
+ */
+int stream_set_notify_ex(struct stream *stream,
+                         void (*on_read)(void *data, struct stream *stream),
+                         void (*on_write)(void *data, struct stream *stream),
+                         void *data);
+
+/**
+ * Set low-watermarks for notifications, as with SO_RCVLOWAT/SO_SNDLOWAT.
+ * A direction is only considered ready once stream_available reports at
+ * least that many bytes readable, or that much space writable (or the
+ * stream has finished). A direction with a watermark only triggers the
+ * stream_set_notify callback once it is reached; one without still
+ * triggers it on every change, as SO_RCVLOWAT leaves POLLOUT alone.
+ * On a socket stream the read watermark is also set as SO_RCVLOWAT, so
+ * blocking reads there wait for that much data too.
+ * 0 disables the watermark for that direction
+ */
+int stream_set_lowat(struct stream *stream, int read_lowat, int write_lowat);
+
+/* Events for stream_wait */
+#define STREAM_READABLE 0x01
+#define STREAM_WRITABLE 0x02
+/* The stream has finished, reported whichever events were asked for */
+#define STREAM_HANGUP 0x04
+/* Spin briefly before sleeping, for low latency handoff between threads */
+#define STREAM_WAIT_SPIN 0x100
+
+/**
+ * Block until the stream is ready for any of the requested 'events'
+ * (STREAM_READABLE/STREAM_WRITABLE, optionally with STREAM_WAIT_SPIN),
+ * honouring any watermarks from stream_set_lowat. Descriptor streams (and
+ * streams layered on them) wait in poll, in-memory streams wait on a futex
+ * which is woken by the other side's reads and writes
+ * @param timeout_ns Maximum time to wait, or < 0 to wait forever
+ * @return < 0 on failure, 0 on timeout, otherwise the STREAM_* events
+ * which are ready
+ */
+int stream_wait(struct stream *stream, int events, int64_t timeout_ns);
+
+/**
+ * Wait for any of 'n' streams, of any mix of types, to become ready.
+ * events[i] holds the STREAM_READABLE/STREAM_WRITABLE events wanted from
+ * streams[i], and revents[i] is filled in with those which are ready (plus
+ * STREAM_HANGUP). A stream may only be in one stream_poll at a time
+ * (-EBUSY otherwise)
+ * @param timeout_ns Maximum time to wait, or < 0 to wait forever
+ * @return < 0 on failure, 0 on timeout, otherwise the number of streams
+ * with events
+ */
+int stream_poll(struct stream **streams, int n, const short *events,
+                short *revents, int64_t timeout_ns);
+
 /**
  * read callback will read up to max_size bytes into the 'result' buffer
  * @return < 0 on failure, number of bytes written to result on success
@@ -62,6 +331,56 @@ int stream_read(struct stream *stream, void *result, const int max_size);
 int stream_write(struct stream *stream, const void *const data,
                  const int data_len);
 
+/**
+ * As for stream_read, but with 64-bit sizes. Large requests are passed
+ * to the stream in pieces, stopping at the first short read
+ */
+ssize_t stream_read64(struct stream *stream, void *result, size_t max_size);
+
+/**
+ * As for stream_write, but with 64-bit sizes. Large requests are passed
+ * to the stream in pieces, stopping at the first short write
+ */
+ssize_t stream_write64(struct stream *stream, const void *const data,
+                       size_t data_len);
+
+/**
+ * Read into each of the 'iovcnt' buffers in 'iov' in turn, using a single
+ * system call where the stream supports it. Streams without native support
+ * stop at the first buffer that isn't completely filled.
+ * @return < 0 on failure, total number of bytes read on success
+ */
+int stream_readv(struct stream *stream, const struct iovec *iov, int iovcnt);
+
+/**
+ * Write out each of the 'iovcnt' buffers in 'iov' in turn, using a single
+ * system call where the stream supports it.
+ * @return < 0 on failure, total number of bytes written on success
+ */
+int stream_writev(struct stream *stream, const struct iovec *iov,
+                  int iovcnt);
+
+/**
+ * Get a pointer to the data that the next read would return, without
+ * copying it or removing it from the stream. For line streams this is the
+ * current line, without its terminator, and empty lines are skipped.
+ * Streams that can't expose their internal storage have the data read
+ * into a buffer attached to the stream instead.
+ * @param ptr Set to the start of the data, valid until the next operation
+ * on the stream
+ * @param len Set to the number of bytes available at ptr
+ * @return < 0 on failure, number of bytes available at ptr on success
+ */
+int stream_peek(struct stream *stream, const void **ptr, int *len);
+
+/**
+ * Remove 'len' bytes of previously peeked data from the stream. Consuming
+ * the rest of a line from a line stream also removes its terminator, while
+ * consuming 0 bytes never changes the stream.
+ * @return < 0 on failure, number of bytes consumed on success
+ */
+int stream_consume(struct stream *stream, int len);
+
 /**
  * Close the metadata associated with thes streaming functions
  * Note: after this has been called, no further callback functions
@@ -78,9 +397,115 @@ int stream_close(struct stream *stream);
  */
 int stream_available(struct stream *stream, int *read, int *write);
 
+/**
+ * As for stream_available, but with 64-bit counts. stream_available caps
+ * its counts at INT_MAX, which this avoids for large memory and mapped
+ * file streams
+ */
+int stream_available64(struct stream *stream, int64_t *read, int64_t *write);
+
+/* Number of buckets in each latency histogram */
+#define STREAM_STATS_BUCKETS 32
+
+/**
+ * Counters kept by a stream once stream_enable_stats is called. Reads are
+ * the calls which hand data over: stream_read(v), stream_consume and
+ * stream_line_next, plus the kernel side of a stream_copy. Times for a
+ * layered stream include the time spent in the streams beneath it.
+ * Counters are updated atomically, so they can be read or reset while
+ * other threads use the stream (ie: both ends of an spsc pipe), although
+ * such a snapshot need not be consistent across counters
+ */
+struct stream_stats {
+    uint64_t reads;
+    uint64_t read_bytes;
+    uint64_t short_reads; /* Returned less than was asked for */
+    uint64_t read_errors;
+    uint64_t writes;
+    uint64_t write_bytes;
+    uint64_t short_writes;
+    uint64_t write_errors;
+    uint64_t peeks;    /* stream_peek calls, timed with the reads */
+    uint64_t notifies; /* Notify callbacks invoked, of either kind */
+    /* Bucket i counts calls taking from 2^i to 2^(i+1) - 1 ns. The last
+     * bucket also holds anything slower */
+    uint64_t read_latency[STREAM_STATS_BUCKETS];
+    uint64_t write_latency[STREAM_STATS_BUCKETS];
+};
+
+/**
+ * Start (or stop, discarding them) collecting statistics for a stream.
+ * Collection costs two clock reads per call, so it is off by default.
+ * This is not thread safe: disabling frees the counters, so it must not
+ * be switched while any other thread is using the stream
+ * @return < 0 on failure, 0 on success
+ */
+int stream_enable_stats(struct stream *stream, bool enable);
+
+/**
+ * Copy out the statistics collected so far
+ * @return < 0 on failure (-ENODATA if they aren't enabled), 0 on success
+ */
+int stream_get_stats(struct stream *stream, struct stream_stats *stats);
+
+/**
+ * Zero the statistics collected so far
+ * @return < 0 on failure (-ENODATA if they aren't enabled), 0 on success
+ */
+int stream_reset_stats(struct stream *stream);
+
+/**
+ * Event loop which watches descriptor based streams (tcp, process) and
+ * calls their notify callbacks as they become ready, instead of each
+ * stream checking for itself after every read/write
+ */
+struct stream_loop;
+
+/**
+ * Create an empty event loop
+ * @return NULL on failure, loop handle on success
+ */
+struct stream_loop *stream_loop_open(void);
+
+/**
+ * Start watching a stream. A stream may only belong to one loop at a time,
+ * and is removed automatically when closed
+ * @return < 0 on failure, 0 on success
+ */
+int stream_loop_add(struct stream_loop *loop, struct stream *stream);
+
+/**
+ * Stop watching a stream
+ * @return < 0 on failure, 0 on success
+ */
+int stream_loop_remove(struct stream_loop *loop, struct stream *stream);
+
+/**
+ * Wait up to timeout_ms (-1 for forever) for streams to become ready, and
+ * call the notify callback of each one that did.
+ * Streams are only reported when they change from not ready to ready, so
+ * callers should consume everything available before waiting again.
+ * @return < 0 on failure, number of streams notified on success
+ */
+int stream_loop_run(struct stream_loop *loop, int timeout_ms);
+
+/**
+ * Destroy an event loop. Any streams still in it are removed from it and
+ * go back to reporting readiness after each operation
+ */
+int stream_loop_close(struct stream_loop *loop);
+
 /**
  * Reads all the data from ont stream and pushes it into another
+ * @return < 0 on failure, number of bytes copied (capped at INT_MAX) on
+ * success
  */
 int stream_copy(struct stream *input_stream, struct stream *output_stream);
 
+/**
+ * As for stream_copy, but returning the full 64-bit count
+ */
+ssize_t stream_copy64(struct stream *input_stream,
+                      struct stream *output_stream);
+
 #endif
@@ -0,0 +1,783 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <linux/perf_event.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "streams.h"
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* System calls made by the measuring thread, counted through the
+ * raw_syscalls:sys_enter tracepoint, and the process's kernel cpu time.
+ * The count is reported as null where tracefs or perf events aren't
+ * available (it usually needs root) */
+static int syscall_counter = -1;
+
+static void syscall_counter_open(void)
+{
+    const char *paths[] = {
+        "/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+        "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id",
+    };
+    unsigned long long id;
+
+    for (size_t i = 0; i < sizeof(paths) / sizeof(paths[0]); i++) {
+        FILE *fp = fopen(paths[i], "r");
+        if (!fp)
+            continue;
+        int found = fscanf(fp, "%llu", &id);
+        fclose(fp);
+        if (found != 1)
+            continue;
+        struct perf_event_attr attr = {
+            .type = PERF_TYPE_TRACEPOINT,
+            .size = sizeof(attr),
+            .config = id,
+        };
+        syscall_counter = syscall(__NR_perf_event_open, &attr, 0, -1, -1,
+                                  PERF_FLAG_FD_CLOEXEC);
+        return;
+    }
+}
+
+static int64_t syscall_count(void)
+{
+    uint64_t count;
+    if (syscall_counter < 0 ||
+        read(syscall_counter, &count, sizeof(count)) != sizeof(count))
+        return -1;
+    return count;
+}
+
+static uint64_t sys_time_ns(void)
+{
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) < 0)
+        return 0;
+    return (uint64_t)ru.ru_stime.tv_sec * 1000000000ull +
+           ru.ru_stime.tv_usec * 1000ull;
+}
+
+static int64_t syscalls_start;
+static uint64_t sys_ns_start;
+
+/* Mark the start of a measurement, returning the time to pass to report */
+static uint64_t bench_start(void)
+{
+    sys_ns_start = sys_time_ns();
+    syscalls_start = syscall_count();
+    return now_ns();
+}
+
+/* Results are written to stdout as a JSON array, one object per
+ * measurement, so runs can be compared between releases. 'ops' is whatever
+ * the benchmark counts: reads, round trips, connections or wakeups */
+static bool first_result = true;
+
+static void report(const char *name, int param, uint64_t bytes,
+                   uint64_t ops, uint64_t elapsed_ns)
+{
+    /* Less the read of the counter itself */
+    int64_t syscalls = syscall_count() - 1;
+    uint64_t sys_ns = sys_time_ns() - sys_ns_start;
+    double secs = elapsed_ns / 1e9;
+    char calls[32] = "null";
+
+    if (syscalls >= 0 && syscalls_start >= 0)
+        snprintf(calls, sizeof(calls), "%lld",
+                 (long long)(syscalls - syscalls_start));
+    printf("%s\n  {\"name\": \"%s\", \"param\": %d, \"bytes\": %llu, "
+           "\"ops\": %llu, \"elapsed_ns\": %llu, \"mb_per_s\": %.1f, "
+           "\"ns_per_op\": %.1f, \"ops_per_s\": %.1f, \"syscalls\": %s, "
+           "\"sys_ns\": %llu}",
+           first_result ? "[" : ",", name, param, (unsigned long long)bytes,
+           (unsigned long long)ops, (unsigned long long)elapsed_ns,
+           bytes / secs / (1024 * 1024),
+           ops ? (double)elapsed_ns / ops : 0.0, ops / secs, calls,
+           (unsigned long long)sys_ns);
+    first_result = false;
+    fflush(stdout);
+}
+
+/* Fill a pipe to capacity and then drain it in small chunks, so the cost
+ * of each read against a large buffer is visible */
+static void bench_pipe_drain(int buffer_size)
+{
+    const int chunk = 64;
+    const uint64_t total = 64 * 1024 * 1024;
+    char *data = calloc(buffer_size, 1);
+    char out[64];
+    uint64_t moved = 0, ops = 0;
+    struct stream *pipe = stream_pipe_open(buffer_size);
+
+    uint64_t start = bench_start();
+    while (moved < total) {
+        int w = stream_write(pipe, data, buffer_size);
+        for (int r = 0; r < w; r += chunk) {
+            stream_read(pipe, out, chunk);
+            ops++;
+        }
+        moved += w;
+    }
+    report("pipe_drain_64", buffer_size, moved, ops, now_ns() - start);
+
+    stream_close(pipe);
+    free(data);
+}
+
+/* Hand data between two threads, either through a plain pipe guarded by a
+ * mutex or through the lock-free spsc pipe */
+struct handoff {
+    struct stream *pipe;
+    pthread_mutex_t *lock;
+    uint64_t total;
+    int chunk;
+};
+
+static int handoff_io(struct handoff *h, bool writing, void *buf, int len)
+{
+    int e;
+    if (h->lock)
+        pthread_mutex_lock(h->lock);
+    if (writing)
+        e = stream_write(h->pipe, buf, len);
+    else
+        e = stream_read(h->pipe, buf, len);
+    if (h->lock)
+        pthread_mutex_unlock(h->lock);
+    if (e == 0)
+        sched_yield();
+    return e;
+}
+
+static void *handoff_producer(void *data)
+{
+    struct handoff *h = data;
+    char *buf = calloc(h->chunk, 1);
+    for (uint64_t moved = 0; moved < h->total;)
+        moved += handoff_io(h, true, buf, h->chunk);
+    free(buf);
+    return NULL;
+}
+
+static void bench_pipe_handoff(const char *name, bool spsc, int chunk)
+{
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    struct handoff h = {
+        .pipe = spsc ? stream_pipe_spsc_open(64 * 1024)
+                     : stream_pipe_open(64 * 1024),
+        .lock = spsc ? NULL : &lock,
+        .total = 64 * 1024 * 1024,
+        .chunk = chunk,
+    };
+    char *buf = calloc(chunk, 1);
+    pthread_t thread;
+    uint64_t moved = 0, ops = 0;
+
+    uint64_t start = bench_start();
+    pthread_create(&thread, NULL, handoff_producer, &h);
+    while (moved < h.total) {
+        moved += handoff_io(&h, false, buf, chunk);
+        ops++;
+    }
+    pthread_join(thread, NULL);
+    report(name, chunk, moved, ops, now_ns() - start);
+
+    stream_close(h.pipe);
+    free(buf);
+}
+
+/* Write and then read back a file in fixed size chunks, through either
+ * stdio or io_uring */
+static void bench_file(const char *name, const char *wmode, const char *rmode,
+                       int chunk)
+{
+    const char *filename = "/tmp/streams_bench_file";
+    const uint64_t total = 64 * 1024 * 1024;
+    char *buf = calloc(chunk, 1);
+    char label[64];
+    uint64_t moved = 0, ops = 0;
+
+    struct stream *file = stream_file_open(filename, wmode);
+    uint64_t start = bench_start();
+    while (moved < total) {
+        moved += stream_write(file, buf, chunk);
+        ops++;
+    }
+    stream_close(file);
+    snprintf(label, sizeof(label), "%s_write", name);
+    report(label, chunk, moved, ops, now_ns() - start);
+
+    file = stream_file_open(filename, rmode);
+    moved = ops = 0;
+    start = bench_start();
+    for (int e; (e = stream_read(file, buf, chunk)) > 0; ops++)
+        moved += e;
+    stream_close(file);
+    snprintf(label, sizeof(label), "%s_read", name);
+    report(label, chunk, moved, ops, now_ns() - start);
+
+    unlink(filename);
+    free(buf);
+}
+
+/* Generate random data in fixed size chunks */
+static void bench_rand(int chunk)
+{
+    const uint64_t total = 256 * 1024 * 1024;
+    char *buf = malloc(chunk);
+    uint64_t moved = 0, ops = 0;
+    struct stream *rand = stream_rand_open_seeded(-1, 1);
+
+    uint64_t start = bench_start();
+    for (; moved < total; ops++)
+        moved += stream_read(rand, buf, chunk);
+    report("rand", chunk, moved, ops, now_ns() - start);
+
+    stream_close(rand);
+    free(buf);
+}
+
+/* Split a memory buffer full of fixed length lines */
+static void bench_line(int line_len)
+{
+    const size_t total = 64 * 1024 * 1024;
+    char *data = malloc(total);
+    char out[1024];
+    uint64_t ops = 0;
+
+    for (size_t i = 0; i < total; i++)
+        data[i] = (i % line_len == (size_t)line_len - 1) ? '\n' : 'x';
+    struct stream *mem = stream_mem_open(data, total, "r");
+    struct stream *line = stream_line_open(mem);
+
+    uint64_t start = bench_start();
+    while (stream_available(line, NULL, NULL) > 0) {
+        stream_read(line, out, sizeof(out));
+        ops++;
+    }
+    report("line_split", line_len, total, ops, now_ns() - start);
+    stream_close(line);
+    stream_close(mem);
+
+    /* The same again, using zero-copy line views */
+    const char *ptr;
+    int len;
+    mem = stream_mem_open(data, total, "r");
+    line = stream_line_open_ex(mem, 64 * 1024, 64 * 1024);
+    ops = 0;
+    start = bench_start();
+    while (stream_available(line, NULL, NULL) > 0)
+        ops += stream_line_next(line, &ptr, &len);
+    report("line_next", line_len, total, ops, now_ns() - start);
+    stream_close(line);
+    stream_close(mem);
+
+    free(data);
+}
+
+/* Push lines through a pipe -> line chain, counting how many callbacks a
+ * consumer would be woken by (reported as ops) with level notifications
+ * against edge triggered read notifications */
+static void count_wakeup(void *data, struct stream *stream)
+{
+    (void)stream;
+    (*(uint64_t *)data)++;
+}
+
+static void bench_wakeups(int chunk)
+{
+    const uint64_t total = 64 * 1024 * 1024;
+    char *data = malloc(chunk);
+    const char *ptr;
+    int len;
+
+    for (int i = 0; i < chunk; i++)
+        data[i] = (i % 64 == 63) ? '\n' : 'x';
+
+    for (int edge = 0; edge < 2; edge++) {
+        struct stream *pipe = stream_pipe_open(64 * 1024);
+        struct stream *line = stream_line_open_ex(pipe, 4096, 4096);
+        uint64_t wakeups = 0, moved = 0;
+
+        if (edge)
+            stream_set_notify_ex(line, count_wakeup, NULL, &wakeups);
+        else
+            stream_set_notify(line, count_wakeup, &wakeups);
+
+        uint64_t start = bench_start();
+        while (moved < total) {
+            int w = stream_write(pipe, data, chunk);
+            moved += w;
+            /* Drain everything once the pipe backs up */
+            if (w < chunk)
+                while (stream_line_next(line, &ptr, &len) > 0)
+                    ;
+        }
+        report(edge ? "notify_edge" : "notify_level", chunk, total, wakeups,
+               now_ns() - start);
+        stream_close(line);
+        stream_close(pipe);
+    }
+    free(data);
+}
+
+/* Connect and disconnect over loopback, with each server thread owning its
+ * own SO_REUSEPORT listener and event loop */
+#define ACCEPT_PORT 13380
+#define ACCEPT_MAX_THREADS 8
+
+struct accept_server {
+    struct stream *listener;
+    atomic_int *accepted;
+    int total;
+};
+
+static void accept_notify(void *data, struct stream *listener)
+{
+    struct accept_server *server = data;
+    struct stream *conn;
+    while ((conn = stream_tcp_accept(listener)) != NULL) {
+        stream_close(conn);
+        atomic_fetch_add(server->accepted, 1);
+    }
+}
+
+static void *accept_thread(void *data)
+{
+    struct accept_server *server = data;
+    struct stream_loop *loop = stream_loop_open();
+
+    stream_set_nonblocking(server->listener, true);
+    stream_set_notify(server->listener, accept_notify, server);
+    stream_loop_add(loop, server->listener);
+    /* Pick up anything that arrived before the listener joined the loop */
+    accept_notify(server, server->listener);
+    while (atomic_load(server->accepted) < server->total)
+        stream_loop_run(loop, 10);
+    stream_loop_remove(loop, server->listener);
+    stream_loop_close(loop);
+    return NULL;
+}
+
+static void *connect_thread(void *data)
+{
+    int count = *(int *)data;
+    for (int i = 0; i < count; i++)
+        stream_close(stream_tcp_open("127.0.0.1", ACCEPT_PORT));
+    return NULL;
+}
+
+static void bench_tcp_accept(int threads)
+{
+    const int total = 4000;
+    int per_thread = total / threads;
+    atomic_int accepted = 0;
+    struct accept_server servers[ACCEPT_MAX_THREADS];
+    pthread_t server_threads[ACCEPT_MAX_THREADS];
+    pthread_t client_threads[ACCEPT_MAX_THREADS];
+
+    for (int i = 0; i < threads; i++) {
+        servers[i].listener = stream_tcp_listen(
+            "127.0.0.1", ACCEPT_PORT, 1024, STREAM_TCP_REUSEPORT);
+        servers[i].accepted = &accepted;
+        servers[i].total = per_thread * threads;
+        if (!servers[i].listener) {
+            while (i-- > 0)
+                stream_close(servers[i].listener);
+            return;
+        }
+    }
+
+    uint64_t start = bench_start();
+    for (int i = 0; i < threads; i++) {
+        pthread_create(&server_threads[i], NULL, accept_thread, &servers[i]);
+        pthread_create(&client_threads[i], NULL, connect_thread,
+                       &per_thread);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(client_threads[i], NULL);
+        pthread_join(server_threads[i], NULL);
+    }
+    report("tcp_accept", threads, 0, accepted, now_ns() - start);
+
+    for (int i = 0; i < threads; i++)
+        stream_close(servers[i].listener);
+}
+
+/* Stream data from a child process through a shared memory ring */
+static void bench_shm(int chunk)
+{
+    const char *name = "/streams_bench_shm";
+    const uint64_t total = 256 * 1024 * 1024;
+    char *buf = calloc(chunk, 1);
+    uint64_t moved = 0, ops = 0;
+
+    shm_unlink(name);
+    struct stream *reader = stream_shm_open(name, 1024 * 1024, "r");
+    if (!reader) {
+        free(buf);
+        return;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        struct stream *writer = stream_shm_open(name, 0, "w");
+        for (uint64_t sent = 0; writer && sent < total;) {
+            stream_wait(writer, STREAM_WRITABLE, -1);
+            int e = stream_write(writer, buf, chunk);
+            if (e < 0)
+                break;
+            sent += e;
+        }
+        stream_close(writer);
+        _exit(0);
+    }
+
+    uint64_t start = bench_start();
+    bool exited = false;
+    while (moved < total) {
+        int ready = stream_wait(reader, STREAM_READABLE, 100 * 1000 * 1000);
+        /* A child which failed to attach never hangs up */
+        if (ready == 0 && waitpid(pid, NULL, WNOHANG) == pid) {
+            exited = true;
+            break;
+        }
+        if (ready < 0 || (ready & STREAM_HANGUP))
+            break;
+        int e = stream_read(reader, buf, chunk);
+        if (e < 0)
+            break;
+        moved += e;
+        ops++;
+    }
+    report("shm_ring", chunk, moved, ops, now_ns() - start);
+
+    if (!exited)
+        waitpid(pid, NULL, 0);
+    stream_close(reader);
+    free(buf);
+}
+
+/* Round trip latency of a small message bounced off an echo thread, over
+ * loopback tcp against unix sockets */
+#define LATENCY_PORT 13390
+#define LATENCY_PATH "/tmp/streams_bench.sock"
+
+static void *echo_thread(void *data)
+{
+    struct stream *conn = stream_tcp_accept(data);
+    char buf[4096];
+    for (int e; (e = stream_read(conn, buf, sizeof(buf))) > 0;)
+        stream_write(conn, buf, e);
+    stream_close(conn);
+    return NULL;
+}
+
+static void bench_latency(const char *name, bool unix_socket, int flags,
+                          int size)
+{
+    const int rounds = 20000;
+    struct stream *listener, *client;
+    char buf[4096] = {0};
+    pthread_t thread;
+
+    unlink(LATENCY_PATH);
+    if (unix_socket)
+        listener = stream_unix_listen(LATENCY_PATH, 1, flags);
+    else
+        listener = stream_tcp_listen("127.0.0.1", LATENCY_PORT, 1, flags);
+    if (!listener)
+        return;
+    if (pthread_create(&thread, NULL, echo_thread, listener) != 0) {
+        stream_close(listener);
+        return;
+    }
+    if (unix_socket)
+        client = stream_unix_open_ex(LATENCY_PATH, flags);
+    else
+        client = stream_tcp_open_ex("127.0.0.1", LATENCY_PORT, flags);
+    if (!client) {
+        /* The echo thread is still waiting in accept, a cancellation
+         * point, for a connection that won't come */
+        pthread_cancel(thread);
+        pthread_join(thread, NULL);
+        stream_close(listener);
+        return;
+    }
+
+    uint64_t start = bench_start();
+    for (int i = 0; i < rounds; i++) {
+        stream_write(client, buf, size);
+        for (int got = 0; got < size;) {
+            int e = stream_read(client, buf, size - got);
+            if (e <= 0)
+                break;
+            got += e;
+        }
+    }
+    report(name, size, (uint64_t)rounds * size * 2, rounds,
+           now_ns() - start);
+
+    stream_close(client);
+    pthread_join(thread, NULL);
+    stream_close(listener);
+}
+
+/* Read and write a memory stream in fixed size chunks */
+static void bench_mem(int chunk)
+{
+    const size_t total = 64 * 1024 * 1024;
+    char *data = malloc(total);
+    char *buf = calloc(chunk, 1);
+    uint64_t moved = 0, ops = 0;
+
+    /* Fault the pages in up front, so they don't count against the first
+     * run */
+    memset(data, 'x', total);
+    struct stream *mem = stream_mem_open(data, total, "r");
+    uint64_t start = bench_start();
+    for (int e; (e = stream_read(mem, buf, chunk)) > 0; ops++)
+        moved += e;
+    report("mem_read", chunk, moved, ops, now_ns() - start);
+    stream_close(mem);
+
+    /* The same again, to show the cost of collecting statistics */
+    mem = stream_mem_open(data, total, "r");
+    stream_enable_stats(mem, true);
+    moved = ops = 0;
+    start = bench_start();
+    for (int e; (e = stream_read(mem, buf, chunk)) > 0; ops++)
+        moved += e;
+    report("mem_read_stats", chunk, moved, ops, now_ns() - start);
+    stream_close(mem);
+
+    mem = stream_mem_open(data, total, "w");
+    moved = ops = 0;
+    start = bench_start();
+    for (int e; (e = stream_write(mem, buf, chunk)) > 0; ops++)
+        moved += e;
+    report("mem_write", chunk, moved, ops, now_ns() - start);
+    stream_close(mem);
+
+    free(buf);
+    free(data);
+}
+
+/* Read the output of a child process through its pty */
+static void bench_process(int chunk)
+{
+    char *args[] = {"head", "-c", "16777216", "/dev/zero", NULL};
+    char *buf = malloc(chunk);
+    uint64_t moved = 0, ops = 0;
+
+    struct stream *proc = stream_process_open(args);
+    if (!proc)
+        return;
+    uint64_t start = bench_start();
+    for (int e; (e = stream_read(proc, buf, chunk)) > 0; ops++)
+        moved += e;
+    report("process_read", chunk, moved, ops, now_ns() - start);
+    stream_close(proc);
+    free(buf);
+}
+
+/* Whole stream copies, between files (where the kernel can copy directly)
+ * and between memory streams (through the generic buffer) */
+static void bench_copy(int size_mb)
+{
+    const char *in_name = "/tmp/streams_bench_copy_in";
+    const char *out_name = "/tmp/streams_bench_copy_out";
+    size_t total = (size_t)size_mb * 1024 * 1024;
+    char *src = calloc(total, 1);
+    char *dst = malloc(total);
+
+    struct stream *in = stream_file_open(in_name, "w");
+    stream_write64(in, src, total);
+    stream_close(in);
+
+    in = stream_file_open(in_name, "r");
+    struct stream *out = stream_file_open(out_name, "w");
+    uint64_t start = bench_start();
+    ssize_t copied = stream_copy64(in, out);
+    report("copy_file", size_mb, copied, 1, now_ns() - start);
+    stream_close(in);
+    stream_close(out);
+
+    in = stream_mem_open(src, total, "r");
+    out = stream_mem_open(dst, total, "w");
+    start = bench_start();
+    copied = stream_copy64(in, out);
+    report("copy_mem", size_mb, copied, 1, now_ns() - start);
+    stream_close(in);
+    stream_close(out);
+
+    unlink(in_name);
+    unlink(out_name);
+    free(src);
+    free(dst);
+}
+
+/* Loopback tcp, fed by a thread which writes 'total' bytes of lines */
+#define TCP_BENCH_PORT 13391
+
+struct tcp_feed {
+    struct stream *listener;
+    uint64_t total;
+    int line_len;
+};
+
+static void *tcp_feed_thread(void *data)
+{
+    struct tcp_feed *feed = data;
+    struct stream *conn = stream_tcp_accept(feed->listener);
+    char buf[65536];
+
+    for (size_t i = 0; i < sizeof(buf); i++)
+        buf[i] = (i % feed->line_len == (size_t)feed->line_len - 1) ? '\n'
+                                                                    : 'x';
+    /* Whole lines only, so the reader sees each one complete */
+    int len = sizeof(buf) - sizeof(buf) % feed->line_len;
+    for (uint64_t sent = 0; conn && sent < feed->total;) {
+        int e = stream_write(conn, buf, len);
+        if (e <= 0)
+            break;
+        sent += e;
+    }
+    stream_close(conn);
+    return NULL;
+}
+
+static struct stream *tcp_feed_start(struct tcp_feed *feed, pthread_t *thread,
+                                     int flags)
+{
+    feed->listener = stream_tcp_listen("127.0.0.1", TCP_BENCH_PORT, 1, 0);
+    if (!feed->listener)
+        return NULL;
+    if (pthread_create(thread, NULL, tcp_feed_thread, feed) != 0) {
+        stream_close(feed->listener);
+        return NULL;
+    }
+    struct stream *client =
+        stream_tcp_open_ex("127.0.0.1", TCP_BENCH_PORT, flags);
+    if (!client) {
+        /* Nothing will connect, so the feed is still sitting in accept,
+         * which is a cancellation point */
+        pthread_cancel(*thread);
+        pthread_join(*thread, NULL);
+        stream_close(feed->listener);
+    }
+    return client;
+}
+
+static void tcp_feed_stop(struct tcp_feed *feed, pthread_t thread,
+                          struct stream *client)
+{
+    stream_close(client);
+    pthread_join(thread, NULL);
+    stream_close(feed->listener);
+}
+
+static void bench_tcp(const char *name, int flags, int chunk)
+{
+    struct tcp_feed feed = {.total = 256 * 1024 * 1024, .line_len = 64};
+    char *buf = malloc(chunk);
+    uint64_t moved = 0, ops = 0;
+    pthread_t thread;
+
+    struct stream *client = tcp_feed_start(&feed, &thread, flags);
+    if (!client) {
+        free(buf);
+        return;
+    }
+    uint64_t start = bench_start();
+    for (int e; (e = stream_read(client, buf, chunk)) > 0; ops++)
+        moved += e;
+    report(name, chunk, moved, ops, now_ns() - start);
+    tcp_feed_stop(&feed, thread, client);
+    free(buf);
+}
+
+/* Layered tcp -> line chain, using zero-copy line views */
+static void bench_tcp_line(int line_len)
+{
+    struct tcp_feed feed = {.total = 64 * 1024 * 1024, .line_len = line_len};
+    const char *ptr;
+    int len;
+    uint64_t moved = 0, ops = 0;
+    pthread_t thread;
+
+    struct stream *client = tcp_feed_start(&feed, &thread, 0);
+    if (!client)
+        return;
+    struct stream *line = stream_line_open_ex(client, 64 * 1024, 64 * 1024);
+    uint64_t start = bench_start();
+    while (stream_line_next(line, &ptr, &len) > 0) {
+        /* Each line also had its terminator */
+        moved += len + 1;
+        ops++;
+    }
+    report("tcp_line_next", line_len, moved, ops, now_ns() - start);
+    stream_close(line);
+    tcp_feed_stop(&feed, thread, client);
+}
+
+int main(void)
+{
+    syscall_counter_open();
+    for (int chunk = 64; chunk <= 65536; chunk *= 32)
+        bench_mem(chunk);
+    for (int size = 1024; size <= 1024 * 1024; size *= 4)
+        bench_pipe_drain(size);
+    for (int chunk = 64; chunk <= 16384; chunk *= 16) {
+        bench_pipe_handoff("pipe_mutex_handoff", false, chunk);
+        bench_pipe_handoff("pipe_spsc_handoff", true, chunk);
+    }
+    for (int chunk = 64; chunk <= 65536; chunk *= 32)
+        bench_rand(chunk);
+    for (int line_len = 16; line_len <= 1024; line_len *= 4)
+        bench_line(line_len);
+    for (int chunk = 512; chunk <= 65536; chunk *= 8) {
+        bench_file("file_stdio", "w", "r", chunk);
+        bench_file("file_uring", "wu", "ru", chunk);
+        bench_file("file_mmap", "w", "rm", chunk);
+    }
+    for (int size_mb = 16; size_mb <= 256; size_mb *= 16)
+        bench_copy(size_mb);
+    for (int chunk = 512; chunk <= 65536; chunk *= 8)
+        bench_process(chunk);
+    for (int chunk = 512; chunk <= 65536; chunk *= 8) {
+        bench_tcp("tcp_read", 0, chunk);
+        bench_tcp("tcp_read_uring", STREAM_TCP_IO_URING, chunk);
+    }
+    for (int line_len = 16; line_len <= 1024; line_len *= 4)
+        bench_tcp_line(line_len);
+    for (int chunk = 64; chunk <= 4096; chunk *= 8)
+        bench_wakeups(chunk);
+    for (int chunk = 4096; chunk <= 262144; chunk *= 8)
+        bench_shm(chunk);
+    for (int size = 64; size <= 4096; size *= 8) {
+        bench_latency("latency_tcp", false, 0, size);
+        bench_latency("latency_unix", true, 0, size);
+        bench_latency("latency_unix_seqpacket", true, STREAM_UNIX_SEQPACKET,
+                      size);
+    }
+    for (int threads = 1; threads <= ACCEPT_MAX_THREADS; threads *= 2)
+        bench_tcp_accept(threads);
+    printf("%s\n", first_result ? "[]" : "\n]");
+    return 0;
+}
@@ -1,5 +1,13 @@
+#include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdbool.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 #include "acutest.h"
 #include "streams.h"
@@ -60,6 +68,166 @@ void test_file(void)
     TEST_CHECK(memcmp(input, output, sizeof(input)) == 0);
 }
 
+void test_copy_file(void)
+{
+    static uint8_t input[300 * 1024];
+    static uint8_t output[sizeof(input)];
+    const char *src_name = "/tmp/test_copy_src";
+    const char *dst_name = "/tmp/test_copy_dst";
+
+    rand_data(input, sizeof(input));
+
+    struct stream *src = stream_file_open(src_name, "w");
+    TEST_CHECK(stream_write(src, input, sizeof(input)) == sizeof(input));
+    TEST_CHECK(stream_close(src) >= 0);
+
+    /* Both ends are files, so this can be done in the kernel */
+    src = stream_file_open(src_name, "r");
+    struct stream *dst = stream_file_open(dst_name, "w");
+    TEST_CHECK(stream_copy(src, dst) == sizeof(input));
+    TEST_CHECK(stream_close(src) >= 0);
+    TEST_CHECK(stream_close(dst) >= 0);
+
+    /* Memory has no descriptor, so this goes through user space */
+    src = stream_file_open(dst_name, "r");
+    dst = stream_mem_open(output, sizeof(output), "w");
+    TEST_CHECK(stream_copy(src, dst) == sizeof(input));
+    TEST_CHECK(stream_close(src) >= 0);
+    TEST_CHECK(stream_close(dst) >= 0);
+    TEST_CHECK(memcmp(input, output, sizeof(input)) == 0);
+
+    /* A non-blocking socket running dry part way reports what was copied,
+     * rather than losing the count to -EAGAIN */
+    struct stream *listener = stream_tcp_listen("localhost", 13376, 4, 0);
+    struct stream *client = stream_tcp_open("localhost", 13376);
+    struct stream *server = stream_tcp_accept(listener);
+    int pending = 0;
+    TEST_CHECK(listener && client && server);
+    TEST_CHECK(stream_write(client, input, 1000) == 1000);
+    for (int i = 0; i < 100; i++) {
+        stream_available(server, &pending, NULL);
+        if (pending == 1000)
+            break;
+        usleep(1000);
+    }
+    TEST_CHECK(stream_set_nonblocking(server, true) == 0);
+    dst = stream_file_open(dst_name, "w");
+    TEST_CHECK(stream_copy(server, dst) == 1000);
+    TEST_CHECK(stream_copy(server, dst) == -EAGAIN);
+    TEST_CHECK(stream_close(dst) >= 0);
+    src = stream_file_open(dst_name, "r");
+    TEST_CHECK(stream_read(src, output, sizeof(output)) == 1000);
+    TEST_CHECK(memcmp(input, output, 1000) == 0);
+    TEST_CHECK(stream_close(src) >= 0);
+    stream_close(server);
+    stream_close(client);
+    stream_close(listener);
+
+    TEST_CHECK(unlink(src_name) >= 0);
+    TEST_CHECK(unlink(dst_name) >= 0);
+}
+
+void test_file_uring(void)
+{
+    static uint8_t input[300 * 1024];
+    static uint8_t output[sizeof(input)];
+    const char *filename = "/tmp/test_uring";
+    int pos;
+
+    rand_data(input, sizeof(input));
+
+    struct stream *file = stream_file_open(filename, "wu");
+    TEST_CHECK(file != NULL);
+    TEST_CHECK(stream_uses_uring(file));
+    for (pos = 0; pos < (int)sizeof(input);) {
+        int len = sizeof(input) - pos < 1000 ? sizeof(input) - pos : 1000;
+        int e = stream_write(file, &input[pos], len);
+        TEST_CHECK(e > 0);
+        if (e <= 0)
+            break;
+        pos += e;
+    }
+    TEST_CHECK(stream_close(file) >= 0);
+
+    file = stream_file_open(filename, "ru");
+    TEST_CHECK(file != NULL);
+    TEST_CHECK(stream_uses_uring(file));
+    for (pos = 0; pos < (int)sizeof(output);) {
+        int e = stream_read(file, &output[pos], 777);
+        TEST_CHECK(e > 0);
+        if (e <= 0)
+            break;
+        pos += e;
+    }
+    TEST_CHECK(stream_read(file, output, 1) == 0);
+    TEST_CHECK(stream_close(file) >= 0);
+    TEST_CHECK(memcmp(input, output, sizeof(input)) == 0);
+
+    /* Copying carries on from what has been read, rather than from the
+     * descriptor's own offset */
+    const char *copy_name = "/tmp/test_uring_copy";
+    file = stream_file_open(filename, "ru");
+    struct stream *dst = stream_file_open(copy_name, "w");
+    TEST_CHECK(stream_read(file, output, 1000) == 1000);
+    TEST_CHECK(stream_copy(file, dst) == sizeof(input) - 1000);
+    TEST_CHECK(stream_close(file) >= 0);
+    TEST_CHECK(stream_close(dst) >= 0);
+    dst = stream_file_open(copy_name, "r");
+    TEST_CHECK(stream_read(dst, output, sizeof(output)) ==
+               sizeof(input) - 1000);
+    TEST_CHECK(memcmp(input + 1000, output, sizeof(input) - 1000) == 0);
+    TEST_CHECK(stream_close(dst) >= 0);
+
+    TEST_CHECK(unlink(copy_name) >= 0);
+    TEST_CHECK(unlink(filename) >= 0);
+}
+
+void test_file_mmap(void)
+{
+    uint8_t input[10000];
+    uint8_t output[sizeof(input)];
+    const char *filename = "/tmp/test_mmap";
+    const void *ptr;
+    int len, avail;
+
+    rand_data(input, sizeof(input));
+
+    struct stream *file = stream_file_open(filename, "w");
+    TEST_CHECK(stream_write(file, input, sizeof(input)) == sizeof(input));
+    TEST_CHECK(stream_close(file) >= 0);
+
+    file = stream_file_open(filename, "rm");
+    TEST_CHECK(file != NULL);
+    TEST_CHECK(stream_available(file, &avail, NULL) == 1);
+    TEST_CHECK(avail == sizeof(input));
+    TEST_CHECK(stream_read(file, output, 1000) == 1000);
+    TEST_CHECK(stream_available(file, &avail, NULL) == 1);
+    TEST_CHECK(avail == sizeof(input) - 1000);
+    TEST_CHECK(stream_peek(file, &ptr, &len) == sizeof(input) - 1000);
+    TEST_CHECK(memcmp(ptr, &input[1000], len) == 0);
+    TEST_CHECK(stream_consume(file, len) == len);
+    TEST_CHECK(stream_available(file, NULL, NULL) == 0);
+    TEST_CHECK(stream_read(file, output, sizeof(output)) == 0);
+    TEST_CHECK(stream_close(file) >= 0);
+    TEST_CHECK(memcmp(input, output, 1000) == 0);
+
+    TEST_CHECK(unlink(filename) >= 0);
+
+    /* A pipe can't be mapped, so it is read normally */
+    int fds[2];
+    char name[32];
+    TEST_CHECK(pipe(fds) == 0);
+    TEST_CHECK(write(fds[1], "pipe", 4) == 4);
+    close(fds[1]);
+    snprintf(name, sizeof(name), "/dev/fd/%d", fds[0]);
+    file = stream_file_open(name, "rm");
+    close(fds[0]);
+    TEST_CHECK(file != NULL);
+    TEST_CHECK(stream_read(file, output, sizeof(output)) == 4);
+    TEST_CHECK(memcmp(output, "pipe", 4) == 0);
+    TEST_CHECK(stream_close(file) >= 0);
+}
+
 struct thread_data {
     struct stream *stream;
     pthread_mutex_t mutex;
@@ -123,6 +291,338 @@ void test_condition(void)
     TEST_CHECK(stream_close(l.stream) >= 0);
 }
 
+static void count_notify(void *data, struct stream *stream)
+{
+    (void)stream;
+    (*(int *)data)++;
+}
+
+void test_notify_ex(void)
+{
+    char buffer[16];
+    int reads = 0, writes = 0;
+    struct stream *pipe = stream_pipe_open(10);
+
+    TEST_CHECK(stream_set_notify_ex(pipe, count_notify, NULL, &reads) >= 0);
+    TEST_CHECK(stream_write(pipe, "abc", 3) == 3);
+    TEST_CHECK(reads == 1);
+    /* Still readable, so no new edge */
+    TEST_CHECK(stream_write(pipe, "def", 3) == 3);
+    TEST_CHECK(stream_read(pipe, buffer, 2) == 2);
+    TEST_CHECK(reads == 1);
+    TEST_CHECK(stream_read(pipe, buffer, sizeof(buffer)) == 4);
+    TEST_CHECK(stream_write(pipe, "ghi", 3) == 3);
+    TEST_CHECK(reads == 2);
+
+    /* Write readiness only returns once a full pipe is drained */
+    TEST_CHECK(stream_set_notify_ex(pipe, NULL, count_notify, &writes) >= 0);
+    TEST_CHECK(stream_write(pipe, "jklmnopq", 8) == 7);
+    TEST_CHECK(writes == 0);
+    TEST_CHECK(stream_read(pipe, buffer, 1) == 1);
+    TEST_CHECK(stream_read(pipe, buffer, 1) == 1);
+    TEST_CHECK(writes == 1);
+
+    stream_close(pipe);
+}
+
+void test_lowat(void)
+{
+    char buffer[64];
+    int level = 0, edge = 0;
+    struct stream *pipe = stream_pipe_open(64);
+
+    TEST_CHECK(stream_set_notify(pipe, count_notify, &level) >= 0);
+    TEST_CHECK(stream_set_notify_ex(pipe, count_notify, NULL, &edge) >= 0);
+    TEST_CHECK(stream_set_lowat(pipe, 16, 0) == 0);
+    TEST_CHECK(stream_set_lowat(pipe, -1, 0) == -EINVAL);
+
+    /* Small writes don't wake anyone until 16 bytes are waiting */
+    for (int i = 0; i < 3; i++)
+        TEST_CHECK(stream_write(pipe, "abcd", 4) == 4);
+    TEST_CHECK(level == 0 && edge == 0);
+    TEST_CHECK(stream_write(pipe, "efgh", 4) == 4);
+    TEST_CHECK(level == 1 && edge == 1);
+    TEST_CHECK(stream_write(pipe, "ijkl", 4) == 4);
+    TEST_CHECK(level == 2 && edge == 1);
+
+    /* Dropping below the watermark resets the edge. The read makes room,
+     * and with no write watermark that still wakes a waiting writer */
+    TEST_CHECK(stream_read(pipe, buffer, 8) == 8);
+    TEST_CHECK(level == 3);
+    TEST_CHECK(stream_write(pipe, "mnop", 4) == 4);
+    TEST_CHECK(edge == 2);
+
+    stream_close(pipe);
+}
+
+static void *delayed_write_thread(void *data)
+{
+    usleep(50 * 1000);
+    stream_write(data, "foo", 3);
+    return NULL;
+}
+
+void test_wait(void)
+{
+    char buffer[16];
+    pthread_t thread;
+    struct stream *pipe = stream_pipe_spsc_open(16);
+
+    /* Nothing arrives, so the wait times out */
+    TEST_CHECK(stream_wait(pipe, STREAM_READABLE, 10 * 1000 * 1000) == 0);
+    TEST_CHECK(stream_wait(pipe, STREAM_WRITABLE, 0) == STREAM_WRITABLE);
+    TEST_CHECK(stream_wait(pipe, 0, 0) == -EINVAL);
+
+    /* Sleep until another thread writes */
+    for (int spin = 0; spin < 2; spin++) {
+        TEST_CHECK(pthread_create(&thread, NULL, delayed_write_thread,
+                                  pipe) == 0);
+        TEST_CHECK(stream_wait(pipe,
+                               STREAM_READABLE |
+                                   (spin ? STREAM_WAIT_SPIN : 0),
+                               -1) == STREAM_READABLE);
+        TEST_CHECK(stream_read(pipe, buffer, sizeof(buffer)) == 3);
+        pthread_join(thread, NULL);
+    }
+    stream_close(pipe);
+
+    /* Descriptor streams wait in poll, including through a line stream */
+    char *args[] = {"sh", "-c", "sleep 0.05 ; echo foo", NULL};
+    struct stream *proc = stream_process_open(args);
+    struct stream *line = stream_line_open(proc);
+    TEST_CHECK(stream_wait(line, STREAM_READABLE, 5000000000ll) &
+               STREAM_READABLE);
+    TEST_CHECK(stream_read(line, buffer, sizeof(buffer)) == 3);
+    stream_close(line);
+    stream_close(proc);
+}
+
+void test_shm(void)
+{
+    const char *name = "/test_shm_ring";
+    const int total = 1024 * 1024;
+    uint8_t buffer[1000];
+    int pos = 0, status;
+
+    shm_unlink(name);
+    struct stream *reader = stream_shm_open(name, 4096, "r");
+    TEST_CHECK(reader != NULL);
+    TEST_CHECK(stream_shm_open(name, 4096, "rw") == NULL);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        /* Write a counting pattern from another process */
+        struct stream *writer = stream_shm_open(name, 0, "w");
+        if (!writer)
+            _exit(1);
+        while (pos < total) {
+            for (int i = 0; i < (int)sizeof(buffer); i++)
+                buffer[i] = pos + i;
+            int len = sizeof(buffer);
+            if (len > total - pos)
+                len = total - pos;
+            if (stream_wait(writer, STREAM_WRITABLE, -1) < 0)
+                _exit(1);
+            pos += stream_write(writer, buffer, len);
+        }
+        stream_close(writer);
+        _exit(0);
+    }
+    TEST_CHECK(pid > 0);
+
+    bool ok = true, exited = false;
+    for (;;) {
+        int ready = stream_wait(reader, STREAM_READABLE, 100 * 1000 * 1000);
+        /* A child which never attached can't hang up, so rather than
+         * waiting forever, check whether it has gone */
+        if (ready == 0 && waitpid(pid, &status, WNOHANG) == pid) {
+            exited = true;
+            break;
+        }
+        if (ready < 0)
+            break;
+        if (!(ready & STREAM_READABLE))
+            continue;
+        int e = stream_read(reader, buffer, sizeof(buffer));
+        if (e == 0 && stream_available(reader, NULL, NULL) == 0)
+            break;
+        for (int i = 0; i < e; i++)
+            ok &= buffer[i] == (uint8_t)(pos + i);
+        pos += e;
+    }
+    TEST_CHECK(ok);
+    TEST_CHECK(pos == total);
+    TEST_CHECK(exited || waitpid(pid, &status, 0) == pid);
+    TEST_CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    TEST_CHECK(stream_close(reader) == 0);
+
+    /* A creator closing before anyone attaches removes the name */
+    reader = stream_shm_open(name, 4096, "r");
+    TEST_CHECK(reader != NULL);
+    TEST_CHECK(stream_close(reader) == 0);
+    TEST_CHECK(shm_unlink(name) < 0 && errno == ENOENT);
+
+    /* One end per role, and the writer hears about the reader going */
+    struct stream *writer = stream_shm_open(name, 16, "w");
+    reader = stream_shm_open(name, 0, "r");
+    TEST_CHECK(writer != NULL && reader != NULL);
+    TEST_CHECK(stream_write(writer, "abcd", 4) == 4);
+    TEST_CHECK(stream_close(reader) == 0);
+    TEST_CHECK(stream_wait(writer, STREAM_WRITABLE, -1) & STREAM_HANGUP);
+    TEST_CHECK(stream_write(writer, "efgh", 4) == -EPIPE);
+
+    /* The name is free for a new ring, which the first writer's creator
+     * must leave alone when it closes */
+    struct stream *other = stream_shm_open(name, 16, "w");
+    TEST_CHECK(other != NULL);
+    TEST_CHECK(stream_close(writer) == 0);
+    TEST_CHECK(stream_shm_open(name, 0, "w") == NULL && errno == EBUSY);
+    reader = stream_shm_open(name, 0, "r");
+    TEST_CHECK(reader != NULL);
+    TEST_CHECK(stream_close(reader) == 0);
+    TEST_CHECK(stream_close(other) == 0);
+}
+
+void test_pipe_wrap(void)
+{
+    char buffer[16];
+    struct stream *pipe = stream_pipe_open(10);
+    TEST_CHECK(pipe != NULL);
+
+    TEST_CHECK(stream_write(pipe, "abcdefg", 7) == 7);
+    TEST_CHECK(stream_read(pipe, buffer, 5) == 5);
+    TEST_CHECK(memcmp(buffer, "abcde", 5) == 0);
+
+    /* This write wraps around the end of the internal buffer */
+    TEST_CHECK(stream_write(pipe, "hijklmnopq", 10) == 8);
+    TEST_CHECK(stream_write(pipe, "x", 1) == 0);
+    TEST_CHECK(stream_read(pipe, buffer, sizeof(buffer)) == 10);
+    TEST_CHECK(memcmp(buffer, "fghijklmno", 10) == 0);
+    TEST_CHECK(stream_read(pipe, buffer, sizeof(buffer)) == 0);
+
+    TEST_CHECK(stream_close(pipe) >= 0);
+}
+
+static void *spsc_write_thread(void *data)
+{
+    struct stream *pipe = data;
+    uint8_t buffer[100];
+    int pos = 0;
+
+    while (pos < 1024 * 1024) {
+        for (int i = 0; i < (int)sizeof(buffer); i++)
+            buffer[i] = pos + i;
+        int e = stream_write(pipe, buffer, sizeof(buffer));
+        if (e < 0)
+            return (void *)1;
+        if (e == 0)
+            sched_yield();
+        pos += e;
+        /* Anything we couldn't write gets regenerated next time around */
+    }
+    return NULL;
+}
+
+void test_pipe_spsc(void)
+{
+    struct stream *pipe = stream_pipe_spsc_open(4096);
+    pthread_t thread;
+    void *retval = NULL;
+    uint8_t buffer[77];
+    int pos = 0;
+    bool ok = true;
+
+    TEST_CHECK(pipe != NULL);
+    TEST_CHECK(pthread_create(&thread, NULL, spsc_write_thread, pipe) >= 0);
+
+    while (pos < 1024 * 1024 && ok) {
+        int e = stream_read(pipe, buffer, sizeof(buffer));
+        if (e < 0)
+            ok = false;
+        if (e == 0)
+            sched_yield();
+        for (int i = 0; i < e; i++)
+            if (buffer[i] != (uint8_t)(pos + i))
+                ok = false;
+        pos += e;
+    }
+    TEST_CHECK(ok);
+
+    TEST_CHECK(pthread_join(thread, &retval) >= 0);
+    TEST_CHECK(retval == NULL);
+    TEST_CHECK(stream_close(pipe) >= 0);
+}
+
+void test_buffered(void)
+{
+    char buffer[64];
+    int avail;
+    struct stream *pipe = stream_pipe_open(1024);
+    struct stream *buf = stream_buffered_open(pipe, 16, 16);
+    TEST_CHECK(buf != NULL);
+
+    /* Small writes are held back until the buffer fills or is flushed */
+    TEST_CHECK(stream_write(buf, "abcd", 4) == 4);
+    TEST_CHECK(stream_write(buf, "efgh", 4) == 4);
+    TEST_CHECK(stream_available(pipe, &avail, NULL) == 1 && avail == 0);
+    TEST_CHECK(stream_flush(buf) == 0);
+    TEST_CHECK(stream_read(pipe, buffer, sizeof(buffer)) == 8);
+    TEST_CHECK(memcmp(buffer, "abcdefgh", 8) == 0);
+
+    /* A write which doesn't fit pushes out what came before it */
+    TEST_CHECK(stream_write(buf, "0123456789", 10) == 10);
+    TEST_CHECK(stream_write(buf, "abcdefghij", 10) == 10);
+    TEST_CHECK(stream_read(pipe, buffer, sizeof(buffer)) == 10);
+    TEST_CHECK(memcmp(buffer, "0123456789", 10) == 0);
+
+    /* Large writes go straight through */
+    TEST_CHECK(stream_write(buf, "0123456789abcdefXYZ", 19) == 19);
+    TEST_CHECK(stream_read(pipe, buffer, sizeof(buffer)) == 29);
+    TEST_CHECK(memcmp(buffer, "abcdefghij0123456789abcdefXYZ", 29) == 0);
+
+    /* Small reads are served from one bigger read of the pipe */
+    TEST_CHECK(stream_write(pipe, "line 1\nline 2\n", 14) == 14);
+    TEST_CHECK(stream_read(buf, buffer, 3) == 3);
+    TEST_CHECK(stream_available(pipe, &avail, NULL) == 1 && avail == 0);
+    TEST_CHECK(stream_available(buf, &avail, NULL) == 1 && avail == 11);
+
+    /* And it can be layered under a line stream */
+    struct stream *line = stream_line_open(buf);
+    TEST_CHECK(stream_read(line, buffer, sizeof(buffer)) == 3);
+    TEST_CHECK(strcmp(buffer, "e 1") == 0);
+    TEST_CHECK(stream_read(line, buffer, sizeof(buffer)) == 6);
+    TEST_CHECK(strcmp(buffer, "line 2") == 0);
+
+    stream_close(line);
+    stream_close(buf);
+
+    /* Without a write buffer, writes go straight to the parent, and don't
+     * flush it every time */
+    struct stream *inner = stream_buffered_open(pipe, 0, 16);
+    buf = stream_buffered_open(inner, 0, 0);
+    TEST_CHECK(stream_write(buf, "abc", 3) == 3);
+    TEST_CHECK(stream_available(pipe, &avail, NULL) == 1 && avail == 0);
+    TEST_CHECK(stream_flush(buf) == 0);
+    TEST_CHECK(stream_read(pipe, buffer, sizeof(buffer)) == 3);
+    stream_close(buf);
+    stream_close(inner);
+    stream_close(pipe);
+
+    /* A failure while pushing out a full buffer is reported, and the write
+     * that filled it isn't kept */
+    const char *name = "/test_buffered_ring";
+    shm_unlink(name);
+    struct stream *writer = stream_shm_open(name, 64, "w");
+    struct stream *reader = stream_shm_open(name, 0, "r");
+    TEST_CHECK(stream_close(reader) == 0);
+    buf = stream_buffered_open(writer, 0, 4);
+    TEST_CHECK(stream_write(buf, "ab", 2) == 2);
+    TEST_CHECK(stream_write(buf, "cd", 2) == -EPIPE);
+    TEST_CHECK(stream_available(buf, NULL, &avail) >= 0 && avail == 2);
+    stream_close(buf);
+    stream_close(writer);
+}
+
 void test_line_reader(void)
 {
     char input_data[] = "line 1\n"
@@ -159,6 +659,436 @@ void test_line_reader(void)
 
     stream_close(line);
     stream_close(input);
+
+    /* Bytes waiting in the parent aren't readable until they make a line */
+    int readable;
+    input = stream_pipe_open(64);
+    line = stream_line_open_ex(input, 4, 6);
+    TEST_CHECK(stream_write(input, "ab", 2) == 2);
+    TEST_CHECK(stream_available(line, &readable, NULL) > 0 && !readable);
+    /* Asking doesn't take anything from the parent */
+    TEST_CHECK(stream_available(input, &readable, NULL) > 0 && readable == 2);
+    TEST_CHECK(stream_write(input, "c\n", 2) == 2);
+    TEST_CHECK(stream_available(line, &readable, NULL) > 0 && readable);
+    TEST_CHECK(stream_read(line, buffer, sizeof(buffer)) == 3);
+    TEST_CHECK(strcmp(buffer, "abc") == 0);
+
+    /* A line too long for the buffer is readable once it has been split */
+    TEST_CHECK(stream_write(input, "abcdefgh", 8) == 8);
+    TEST_CHECK(stream_available(line, &readable, NULL) > 0 && readable);
+    TEST_CHECK(stream_read(line, buffer, sizeof(buffer)) == 6);
+    TEST_CHECK(stream_available(line, &readable, NULL) > 0 && !readable);
+    stream_close(line);
+    stream_close(input);
+
+    /* A parent that can't be looked into might finish a line, and asking
+     * must not block on it even though nothing has been written */
+    int fds[2];
+    char name[32];
+    TEST_CHECK(pipe(fds) == 0);
+    snprintf(name, sizeof(name), "/dev/fd/%d", fds[0]);
+    input = stream_file_open(name, "r");
+    line = stream_line_open(input);
+    TEST_CHECK(stream_available(line, &readable, NULL) > 0 && readable);
+    stream_close(line);
+    stream_close(input);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+void test_line_lengths(void)
+{
+    static char input[8192];
+    const char *breaks[] = {"\n", "\r\n", "\r"};
+    char buffer[256];
+    int pos = 0;
+
+    /* Lines of every length either side of the vector widths */
+    for (int i = 0; i < 100; i++) {
+        memset(&input[pos], 'a' + i % 26, i);
+        pos += i;
+        strcpy(&input[pos], breaks[i % 3]);
+        pos += strlen(breaks[i % 3]);
+    }
+
+    struct stream *mem = stream_mem_open(input, pos, "r");
+    struct stream *line = stream_line_open(mem);
+    for (int i = 0; i < 100; i++) {
+        int e = stream_read(line, buffer, sizeof(buffer));
+        TEST_CHECK_(e == i, "line %d length %d", i, e);
+        TEST_CHECK(strspn(buffer, (char[]){'a' + i % 26, 0}) == (size_t)i);
+    }
+    TEST_CHECK(stream_available(line, NULL, NULL) == 0);
+    stream_close(line);
+    stream_close(mem);
+}
+
+void test_line_next(void)
+{
+    char input[] = "short\n"
+                   "this line is longer than twenty\n"
+                   "fifteen letters\r\n";
+    const char *ptr;
+    int len;
+
+    struct stream *mem = stream_mem_open(input, sizeof(input) - 1, "r");
+    struct stream *line = stream_line_open_ex(mem, 8, 20);
+    TEST_CHECK(line != NULL);
+
+    TEST_CHECK(stream_line_next(line, &ptr, &len) == 1);
+    TEST_CHECK(len == 5 && memcmp(ptr, "short", 5) == 0);
+
+    /* Too long, so it comes back in two pieces */
+    while (stream_line_next(line, &ptr, &len) == 0)
+        ;
+    TEST_CHECK(len == 20 && memcmp(ptr, "this line is longer ", 20) == 0);
+    TEST_CHECK(stream_line_next(line, &ptr, &len) == 1);
+    TEST_CHECK(len == 11 && memcmp(ptr, "than twenty", 11) == 0);
+
+    while (stream_line_next(line, &ptr, &len) == 0)
+        ;
+    TEST_CHECK(len == 15 && memcmp(ptr, "fifteen letters", 15) == 0);
+    TEST_CHECK(stream_line_next(line, &ptr, &len) == 0);
+    TEST_CHECK(stream_available(line, NULL, NULL) == 0);
+
+    /* Only line streams can be used */
+    TEST_CHECK(stream_line_next(mem, &ptr, &len) < 0);
+
+    stream_close(line);
+    stream_close(mem);
+}
+
+static int alloc_count;
+
+static void *counting_alloc(size_t size)
+{
+    alloc_count++;
+    return malloc(size);
+}
+
+static void counting_free(void *ptr)
+{
+    alloc_count--;
+    free(ptr);
+}
+
+void test_storage(void)
+{
+    char input[] = "one\ntwo\n";
+    char buffer[16];
+    /* Sized by the API, rather than guessing at struct sizes */
+    size_t mem_size = stream_mem_storage_size();
+    size_t line_size = stream_line_storage_size(64);
+    uint8_t *mem_storage = malloc(mem_size);
+    uint8_t *line_storage = malloc(line_size);
+    TEST_CHECK(mem_storage && line_storage);
+
+    stream_set_allocator(counting_alloc, counting_free);
+
+    /* Built entirely in caller storage, so nothing is allocated */
+    TEST_CHECK(stream_mem_init(mem_storage, mem_size - 1, input, 8, "r") ==
+               NULL);
+    struct stream *mem =
+        stream_mem_init(mem_storage, mem_size, input, 8, "r");
+    TEST_CHECK(mem == (struct stream *)mem_storage);
+    struct stream *line =
+        stream_line_init(line_storage, line_size, mem, 64, 64);
+    TEST_CHECK(line != NULL);
+    TEST_CHECK(stream_read(line, buffer, sizeof(buffer)) == 3);
+    TEST_CHECK(strcmp(buffer, "one") == 0);
+    TEST_CHECK(alloc_count == 0);
+    TEST_CHECK(stream_close(line) >= 0);
+    TEST_CHECK(stream_close(mem) >= 0);
+
+    /* Too small */
+    TEST_CHECK(stream_pipe_storage_size(1024) > mem_size);
+    TEST_CHECK(stream_pipe_init(mem_storage, mem_size, 1024) == NULL);
+
+    /* Normal opens go through the allocator */
+    struct stream *pipe = stream_pipe_open(1024);
+    TEST_CHECK(alloc_count == 1);
+    TEST_CHECK(stream_close(pipe) >= 0);
+    TEST_CHECK(alloc_count == 0);
+
+    stream_set_allocator(NULL, NULL);
+    free(mem_storage);
+    free(line_storage);
+}
+
+void test_peek(void)
+{
+    char input_data[] = "line 1\nline 2\n";
+    char buffer[80];
+    const void *ptr;
+    int len;
+
+    /* Memory streams expose the underlying memory directly */
+    struct stream *mem = stream_mem_open(input_data, 14, "r");
+    TEST_CHECK(stream_peek(mem, &ptr, &len) == 14);
+    TEST_CHECK(ptr == input_data);
+    TEST_CHECK(stream_consume(mem, 5) == 5);
+    TEST_CHECK(stream_read(mem, buffer, 1) == 1);
+    TEST_CHECK(buffer[0] == '1');
+
+    /* Line streams expose one line at a time */
+    struct stream *line = stream_line_open(mem);
+    TEST_CHECK(stream_peek(line, &ptr, &len) == 6); /* skips rest of 1 */
+    TEST_CHECK(memcmp(ptr, "line 2", 6) == 0);
+    TEST_CHECK(stream_consume(line, 0) == 0);
+    TEST_CHECK(stream_peek(line, &ptr, &len) == 6);
+    TEST_CHECK(memcmp(ptr, "line 2", 6) == 0);
+    TEST_CHECK(stream_consume(line, 7) < 0);
+    TEST_CHECK(stream_consume(line, 6) == 6);
+    TEST_CHECK(stream_available(line, NULL, NULL) == 0);
+    stream_close(line);
+    stream_close(mem);
+
+    /* Pipes only expose the contiguous part of their ring */
+    struct stream *pipe = stream_pipe_open(8);
+    TEST_CHECK(stream_write(pipe, "abcdef", 6) == 6);
+    TEST_CHECK(stream_consume(pipe, 4) == 4);
+    TEST_CHECK(stream_write(pipe, "ghijkl", 6) == 6);
+    TEST_CHECK(stream_peek(pipe, &ptr, &len) == 4);
+    TEST_CHECK(memcmp(ptr, "efgh", 4) == 0);
+    TEST_CHECK(stream_consume(pipe, 4) == 4);
+    TEST_CHECK(stream_peek(pipe, &ptr, &len) == 4);
+    TEST_CHECK(memcmp(ptr, "ijkl", 4) == 0);
+    stream_close(pipe);
+
+    /* Random streams have no native support, so use the fallback */
+    struct stream *rand = stream_rand_open(100);
+    TEST_CHECK(stream_peek(rand, &ptr, &len) == 100);
+    memcpy(buffer, ptr, 10);
+    TEST_CHECK(stream_consume(rand, 2) == 2);
+    TEST_CHECK(stream_read(rand, &buffer[20], 8) == 8);
+    TEST_CHECK(memcmp(&buffer[2], &buffer[20], 8) == 0);
+    TEST_CHECK(stream_consume(rand, 91) < 0);
+    stream_close(rand);
+}
+
+void test_rand(void)
+{
+    uint8_t a[1000], b[1000];
+
+    /* The same seed gives the same bytes, however the reads are split */
+    struct stream *one = stream_rand_open_seeded(sizeof(a), 1234);
+    struct stream *two = stream_rand_open_seeded(-1, 1234);
+    TEST_CHECK(stream_read(one, a, sizeof(a)) == sizeof(a));
+    TEST_CHECK(stream_read(one, a, sizeof(a)) == 0);
+    for (int pos = 0, step = 1; pos < (int)sizeof(b); pos += step++) {
+        int len = step;
+        if (len > (int)sizeof(b) - pos)
+            len = sizeof(b) - pos;
+        TEST_CHECK(stream_read(two, &b[pos], len) == len);
+    }
+    TEST_CHECK(memcmp(a, b, sizeof(a)) == 0);
+    stream_close(one);
+    stream_close(two);
+
+    /* Different seeds, and unseeded streams, differ */
+    one = stream_rand_open_seeded(-1, 1235);
+    TEST_CHECK(stream_read(one, b, sizeof(b)) == sizeof(b));
+    TEST_CHECK(memcmp(a, b, sizeof(a)) != 0);
+    stream_close(one);
+    one = stream_rand_open(-1);
+    two = stream_rand_open(-1);
+    TEST_CHECK(stream_read(one, a, sizeof(a)) == sizeof(a));
+    TEST_CHECK(stream_read(two, b, sizeof(b)) == sizeof(b));
+    TEST_CHECK(memcmp(a, b, sizeof(a)) != 0);
+    stream_close(one);
+    stream_close(two);
+}
+
+void test_stats(void)
+{
+    char buffer[16];
+    struct stream_stats stats;
+    int notified = 0;
+
+    struct stream *pipe = stream_pipe_open(64);
+    struct stream *line = stream_line_open(pipe);
+    TEST_CHECK(stream_get_stats(pipe, &stats) == -ENODATA);
+    TEST_CHECK(stream_enable_stats(pipe, true) == 0);
+    TEST_CHECK(stream_enable_stats(line, true) == 0);
+    TEST_CHECK(stream_set_notify_ex(line, count_notify, NULL, &notified) ==
+               0);
+
+    TEST_CHECK(stream_write(pipe, "one\ntwo\n", 8) == 8);
+    TEST_CHECK(stream_read(line, buffer, sizeof(buffer)) == 3);
+    TEST_CHECK(stream_read(line, buffer, sizeof(buffer)) == 3);
+
+    TEST_CHECK(stream_get_stats(pipe, &stats) == 0);
+    TEST_CHECK(stats.writes == 1 && stats.write_bytes == 8);
+    TEST_CHECK(stats.short_writes == 0 && stats.write_errors == 0);
+    TEST_CHECK(stats.reads >= 1 && stats.read_bytes == 8);
+    uint64_t total = 0;
+    for (int i = 0; i < STREAM_STATS_BUCKETS; i++)
+        total += stats.read_latency[i];
+    TEST_CHECK(total == stats.reads);
+
+    /* The line stream's reads are counted separately from its parent's */
+    TEST_CHECK(stream_get_stats(line, &stats) == 0);
+    TEST_CHECK(stats.reads == 2 && stats.read_bytes == 6);
+    TEST_CHECK(stats.short_reads == 2);
+    TEST_CHECK(stats.notifies == (uint64_t)notified && notified > 0);
+
+    TEST_CHECK(stream_reset_stats(line) == 0);
+    TEST_CHECK(stream_get_stats(line, &stats) == 0);
+    TEST_CHECK(stats.reads == 0 && stats.notifies == 0);
+    TEST_CHECK(stream_enable_stats(line, false) == 0);
+    TEST_CHECK(stream_get_stats(line, &stats) == -ENODATA);
+
+    /* Zero-copy line views count as reads too */
+    const char *ptr;
+    int len;
+    TEST_CHECK(stream_enable_stats(line, true) == 0);
+    TEST_CHECK(stream_write(pipe, "three\n", 6) == 6);
+    TEST_CHECK(stream_line_next(line, &ptr, &len) == 1 && len == 5);
+    TEST_CHECK(stream_get_stats(line, &stats) == 0);
+    TEST_CHECK(stats.reads == 1 && stats.read_bytes == 5);
+    TEST_CHECK(stats.short_reads == 0);
+
+    stream_close(line);
+    stream_close(pipe);
+
+    /* A file has no native peek, so peeking reads ahead into a buffer.
+     * The bytes are counted as they are consumed or read from there */
+    const char *filename = "/tmp/test_stats";
+    const void *peeked;
+    struct stream *file = stream_file_open(filename, "w");
+    TEST_CHECK(stream_write(file, "abcdefgh", 8) == 8);
+    TEST_CHECK(stream_close(file) >= 0);
+    file = stream_file_open(filename, "r");
+    TEST_CHECK(stream_enable_stats(file, true) == 0);
+    TEST_CHECK(stream_peek(file, &peeked, &len) == 8);
+    TEST_CHECK(stream_consume(file, 3) == 3);
+    TEST_CHECK(stream_read(file, buffer, sizeof(buffer)) == 5);
+    TEST_CHECK(stream_get_stats(file, &stats) == 0);
+    TEST_CHECK(stats.peeks == 1);
+    TEST_CHECK(stats.reads == 2 && stats.read_bytes == 8);
+    total = 0;
+    for (int i = 0; i < STREAM_STATS_BUCKETS; i++)
+        total += stats.read_latency[i];
+    TEST_CHECK(total == stats.reads + stats.peeks);
+    TEST_CHECK(stream_close(file) >= 0);
+
+    /* Copies done in the kernel count once on each side */
+    const char *copy_name = "/tmp/test_stats_copy";
+    file = stream_file_open(filename, "r");
+    struct stream *copy = stream_file_open(copy_name, "w");
+    TEST_CHECK(stream_enable_stats(file, true) == 0);
+    TEST_CHECK(stream_enable_stats(copy, true) == 0);
+    int read_notified = 0, write_notified = 0;
+    TEST_CHECK(stream_set_notify(file, count_notify, &read_notified) >= 0);
+    TEST_CHECK(stream_set_notify(copy, count_notify, &write_notified) >= 0);
+    TEST_CHECK(stream_copy(file, copy) == 8);
+    TEST_CHECK(stream_get_stats(file, &stats) == 0);
+    TEST_CHECK(stats.reads == 1 && stats.read_bytes == 8);
+    TEST_CHECK(stream_get_stats(copy, &stats) == 0);
+    TEST_CHECK(stats.writes == 1 && stats.write_bytes == 8);
+    /* Both ends hear about it, as they would for a read and a write */
+    TEST_CHECK(read_notified == 1 && write_notified == 1);
+    TEST_CHECK(stream_close(file) >= 0);
+    TEST_CHECK(stream_close(copy) >= 0);
+
+    TEST_CHECK(unlink(filename) >= 0);
+    TEST_CHECK(unlink(copy_name) >= 0);
+}
+
+void test_vectored(void)
+{
+    const char *filename = "/tmp/test_vectored";
+    char head[4], body[8], tail[16];
+    struct iovec out[] = {
+        {"head", 4},
+        {"body....", 8},
+        {"tail", 4},
+    };
+    struct iovec in[] = {
+        {head, sizeof(head)},
+        {body, sizeof(body)},
+        {tail, sizeof(tail)},
+    };
+
+    /* Files use native readv/writev, mixed with buffered reads */
+    struct stream *file = stream_file_open(filename, "w");
+    TEST_CHECK(stream_write(file, "x", 1) == 1);
+    TEST_CHECK(stream_writev(file, out, 3) == 16);
+    TEST_CHECK(stream_close(file) >= 0);
+
+    file = stream_file_open(filename, "r");
+    TEST_CHECK(stream_read(file, tail, 1) == 1);
+    TEST_CHECK(stream_readv(file, in, 3) == 16);
+    TEST_CHECK(memcmp(head, "head", 4) == 0);
+    TEST_CHECK(memcmp(body, "body....", 8) == 0);
+    TEST_CHECK(memcmp(tail, "tail", 4) == 0);
+    TEST_CHECK(stream_writev(file, out, 3) == -ENOTSUP);
+    TEST_CHECK(stream_close(file) >= 0);
+    TEST_CHECK(unlink(filename) >= 0);
+
+    /* stdio's read-ahead on a FIFO must not be lost to the vectored read */
+    unlink(filename);
+    TEST_CHECK(mkfifo(filename, 0600) >= 0);
+    int fd = open(filename, O_RDWR);
+    TEST_CHECK(fd >= 0);
+    file = stream_file_open(filename, "rm");
+    TEST_CHECK(write(fd, "abcdefgh", 8) == 8);
+    close(fd);
+    TEST_CHECK(stream_read(file, tail, 1) == 1);
+    TEST_CHECK(stream_readv(file, in, 3) == 7);
+    TEST_CHECK(memcmp(head, "bcde", 4) == 0);
+    TEST_CHECK(memcmp(body, "fgh", 3) == 0);
+    TEST_CHECK(stream_close(file) >= 0);
+    TEST_CHECK(unlink(filename) >= 0);
+
+    /* Pipes use the generic fallback */
+    struct stream *pipe = stream_pipe_open(10);
+    TEST_CHECK(stream_writev(pipe, out, 3) == 10);
+    memset(tail, 0, sizeof(tail));
+    TEST_CHECK(stream_readv(pipe, in, 3) == 10);
+    TEST_CHECK(memcmp(head, "head", 4) == 0);
+    TEST_CHECK(memcmp(body, "body..", 6) == 0);
+    TEST_CHECK(tail[0] == '\0');
+    stream_close(pipe);
+}
+
+void test_large(void)
+{
+    const char *filename = "/tmp/test_large";
+    char data[32] = {0}, result[32];
+    int64_t read64, write64;
+    int read, write;
+
+    /* Small transfers behave like stream_read/stream_write */
+    struct stream *mem = stream_mem_open(data, sizeof(data), "w");
+    TEST_CHECK(stream_write64(mem, "hello world", 11) == 11);
+    TEST_CHECK(stream_available64(mem, NULL, &write64) > 0);
+    TEST_CHECK(write64 == sizeof(data) - 11);
+    stream_close(mem);
+    mem = stream_mem_open(data, sizeof(data), "r");
+    TEST_CHECK(stream_read64(mem, result, sizeof(result)) == sizeof(data));
+    TEST_CHECK(strcmp(result, "hello world") == 0);
+    TEST_CHECK(stream_read64(mem, result, sizeof(result)) == 0);
+    stream_close(mem);
+
+    /* A sparse file larger than INT_MAX, mapped into memory */
+    const int64_t size = 3ll * 1024 * 1024 * 1024;
+    int fd = open(filename, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    TEST_CHECK(fd >= 0);
+    TEST_CHECK(ftruncate(fd, size) == 0);
+    close(fd);
+
+    struct stream *file = stream_file_open(filename, "rm");
+    TEST_CHECK(file != NULL);
+    TEST_CHECK(stream_available64(file, &read64, NULL) > 0);
+    TEST_CHECK(read64 == size);
+    TEST_CHECK(stream_available(file, &read, &write) > 0);
+    TEST_CHECK(read == INT_MAX);
+    TEST_CHECK(stream_read(file, result, sizeof(result)) == sizeof(result));
+    TEST_CHECK(stream_available64(file, &read64, NULL) > 0);
+    TEST_CHECK(read64 == size - (int64_t)sizeof(result));
+    stream_close(file);
+    TEST_CHECK(unlink(filename) >= 0);
 }
 
 void test_process(void)
@@ -175,6 +1105,16 @@ void test_process(void)
     TEST_CHECK(stream_read(line, buffer, sizeof(buffer)) == 4);
     TEST_CHECK(strcmp(buffer, "blah") == 0);
 
+    /* All the output has been consumed and the process has exited */
+    int e = 1;
+    for (int i = 0; i < 1000; i++) {
+        e = stream_available(proc, NULL, NULL);
+        if (e != 1)
+            break;
+        usleep(1000);
+    }
+    TEST_CHECK(e == 0);
+
     stream_close(line);
     stream_close(proc);
 }
@@ -199,6 +1139,82 @@ void test_process_interactive(void)
     stream_close(proc);
 }
 
+void test_nonblocking(void)
+{
+    char buffer[1024];
+    char *args[] = {"sh", "-c", "read foo ; echo -${foo}-", NULL};
+    int read, write;
+    struct stream *proc = stream_process_open(args);
+    TEST_CHECK(proc != NULL);
+
+    TEST_CHECK(stream_set_nonblocking(proc, true) == 0);
+    /* Nothing has been sent yet, so there's nothing to read */
+    TEST_CHECK(stream_read(proc, buffer, sizeof(buffer)) == -EAGAIN);
+    TEST_CHECK(stream_available(proc, &read, &write) == 1);
+    TEST_CHECK(read == 0 && write == 1);
+
+    TEST_CHECK(stream_write(proc, "wibble\n", 7) == 7);
+    struct stream *line = stream_line_open(proc);
+    for (int i = 0; i < 2; i++) {
+        int e;
+        while ((e = stream_read(line, buffer, sizeof(buffer))) == -EAGAIN)
+            usleep(1000);
+        TEST_CHECK(e > 0);
+    }
+    TEST_CHECK(strcmp(buffer, "-wibble-") == 0);
+
+    TEST_CHECK(stream_set_nonblocking(proc, false) == 0);
+    stream_close(line);
+    stream_close(proc);
+
+    struct stream *pipe = stream_pipe_open(10);
+    TEST_CHECK(stream_set_nonblocking(pipe, true) == -EOPNOTSUPP);
+    stream_close(pipe);
+}
+
+void test_loop(void)
+{
+    char buffer[1024];
+    char *args[] = {"printf", "foo\\n", NULL};
+    int notified = 0;
+
+    struct stream_loop *loop = stream_loop_open();
+    TEST_CHECK(loop != NULL);
+
+    struct stream *proc = stream_process_open(args);
+    TEST_CHECK(proc != NULL);
+    TEST_CHECK(stream_set_notify(proc, count_notify, &notified) >= 0);
+    TEST_CHECK(stream_loop_add(loop, proc) == 0);
+    TEST_CHECK(stream_loop_add(loop, proc) < 0);
+
+    /* Memory streams have no descriptor to watch */
+    struct stream *mem = stream_mem_open(buffer, sizeof(buffer), "r");
+    TEST_CHECK(stream_loop_add(loop, mem) == -ENOTSUP);
+    stream_close(mem);
+
+    TEST_CHECK(stream_loop_run(loop, 5000) == 1);
+    TEST_CHECK(notified == 1);
+    TEST_CHECK(stream_read(proc, buffer, sizeof(buffer)) > 0);
+    TEST_CHECK(notified == 1); /* Not notified inline any more */
+
+    TEST_CHECK(stream_close(proc) >= 0);
+    TEST_CHECK(stream_loop_close(loop) >= 0);
+
+    /* Closing the loop first detaches its members */
+    loop = stream_loop_open();
+    TEST_CHECK(loop != NULL);
+    struct stream *first = stream_process_open(args);
+    struct stream *second = stream_process_open(args);
+    TEST_CHECK(stream_loop_add(loop, first) == 0);
+    TEST_CHECK(stream_loop_add(loop, second) == 0);
+    TEST_CHECK(stream_loop_remove(loop, first) == 0);
+    TEST_CHECK(stream_loop_add(loop, first) == 0);
+    TEST_CHECK(stream_loop_close(loop) >= 0);
+    TEST_CHECK(stream_read(first, buffer, sizeof(buffer)) > 0);
+    TEST_CHECK(stream_close(first) >= 0);
+    TEST_CHECK(stream_close(second) >= 0);
+}
+
 void test_tcp(void)
 {
     struct stream *tcp;
@@ -219,11 +1235,285 @@ void test_tcp(void)
     stream_close(tcp);
 }
 
+void test_tcp_uring(void)
+{
+    struct stream *tcp;
+    char buffer[1024];
+
+    system("yes | nohup nc -l 13371 &");
+    sleep(1);
+
+    tcp = stream_tcp_open_ex("localhost", 13371, STREAM_TCP_IO_URING);
+    TEST_CHECK(tcp != NULL);
+    TEST_CHECK(stream_uses_uring(tcp));
+    struct stream *line = stream_line_open(tcp);
+
+    for (int i = 0; i < 100; i++) {
+        TEST_CHECK(stream_read(line, buffer, sizeof(buffer)) == 1);
+        TEST_CHECK(strcmp(buffer, "y") == 0);
+    }
+    stream_close(line);
+    stream_close(tcp);
+
+    /* Waiting, polling and non-blocking reads go through the socket */
+    struct stream *listener = stream_tcp_listen("localhost", 13374, 4, 0);
+    struct stream *client =
+        stream_tcp_open_ex("localhost", 13374, STREAM_TCP_IO_URING);
+    struct stream *server = stream_tcp_accept(listener);
+    TEST_CHECK(listener && client && server);
+    TEST_CHECK(stream_uses_uring(client));
+
+    TEST_CHECK(stream_wait(client, STREAM_READABLE, 10 * 1000 * 1000) == 0);
+    TEST_CHECK(stream_set_nonblocking(client, true) == 0);
+    TEST_CHECK(stream_read(client, buffer, sizeof(buffer)) == -EAGAIN);
+    TEST_CHECK(stream_set_nonblocking(client, false) == 0);
+
+    pthread_t thread;
+    TEST_CHECK(pthread_create(&thread, NULL, delayed_write_thread, server) ==
+               0);
+    TEST_CHECK(stream_wait(client, STREAM_READABLE, 5000000000ll) ==
+               STREAM_READABLE);
+    pthread_join(thread, NULL);
+    TEST_CHECK(stream_read(client, buffer, sizeof(buffer)) == 3);
+
+    short events = STREAM_READABLE, revents;
+    TEST_CHECK(stream_write(server, "bar", 3) == 3);
+    TEST_CHECK(stream_poll(&client, 1, &events, &revents, 5000000000ll) ==
+               1);
+    TEST_CHECK(revents == STREAM_READABLE);
+
+    /* Vectored i/o is scattered from, and gathered into, the ring */
+    struct iovec iov[2] = {{buffer, 1}, {buffer + 1, 2}};
+    TEST_CHECK(stream_readv(client, iov, 2) == 3);
+    TEST_CHECK(memcmp(buffer, "bar", 3) == 0);
+    struct iovec out[2] = {{"ab", 2}, {"cd", 2}};
+    TEST_CHECK(stream_writev(client, out, 2) == 4);
+    TEST_CHECK(stream_flush(client) == 0);
+    TEST_CHECK(stream_read(server, buffer, sizeof(buffer)) == 4);
+    TEST_CHECK(memcmp(buffer, "abcd", 4) == 0);
+
+    stream_close(client);
+    stream_close(server);
+    stream_close(listener);
+}
+
+void test_tcp_listen(void)
+{
+    char buffer[16];
+    int read, write;
+
+    struct stream *listener =
+        stream_tcp_listen("localhost", 13372, 4, STREAM_TCP_REUSEPORT);
+    TEST_CHECK(listener != NULL);
+    TEST_CHECK(stream_read(listener, buffer, sizeof(buffer)) < 0);
+
+    /* Nobody has connected yet */
+    TEST_CHECK(stream_set_nonblocking(listener, true) == 0);
+    TEST_CHECK(stream_tcp_accept(listener) == NULL && errno == EAGAIN);
+    TEST_CHECK(stream_available(listener, &read, NULL) == 1 && read == 0);
+
+    /* A second listener can share the port */
+    struct stream *other =
+        stream_tcp_listen("localhost", 13372, 4, STREAM_TCP_REUSEPORT);
+    TEST_CHECK(other != NULL);
+    stream_close(other);
+
+    struct stream *client = stream_tcp_open("localhost", 13372);
+    TEST_CHECK(client != NULL);
+    TEST_CHECK(stream_set_nonblocking(listener, false) == 0);
+    struct stream *server = stream_tcp_accept(listener);
+    TEST_CHECK(server != NULL);
+
+    TEST_CHECK(stream_available(server, &read, &write) == 1);
+    TEST_CHECK(read == 0 && write > 0);
+    TEST_CHECK(stream_write(client, "ping", 4) == 4);
+    for (int i = 0; i < 100; i++) {
+        stream_available(server, &read, NULL);
+        if (read != 0)
+            break;
+        usleep(1000);
+    }
+    TEST_CHECK(read == 4);
+    TEST_CHECK(stream_read(server, buffer, sizeof(buffer)) == 4);
+    TEST_CHECK(memcmp(buffer, "ping", 4) == 0);
+    TEST_CHECK(stream_write(server, "pong", 4) == 4);
+    TEST_CHECK(stream_read(client, buffer, sizeof(buffer)) == 4);
+    TEST_CHECK(memcmp(buffer, "pong", 4) == 0);
+
+    /* Short of a watermark, waits sleep rather than spinning on a socket
+     * that is already readable, both through a layered stream and when
+     * the watermark can be handed to the socket itself */
+    struct stream *buffered = stream_buffered_open(server, 64, 0);
+    short events = STREAM_READABLE, revents;
+    struct timespec cpu_start, cpu_end;
+    TEST_CHECK(stream_write(client, "x", 1) == 1);
+    TEST_CHECK(stream_set_lowat(buffered, 16, 0) == 0);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_start);
+    TEST_CHECK(stream_wait(buffered, STREAM_READABLE, 100000000) == 0);
+    TEST_CHECK(stream_poll(&buffered, 1, &events, &revents, 100000000) ==
+               0);
+    TEST_CHECK(stream_set_lowat(server, 16, 0) == 0);
+    TEST_CHECK(stream_wait(server, STREAM_READABLE, 100000000) == 0);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_end);
+    int64_t cpu_ns = (cpu_end.tv_sec - cpu_start.tv_sec) * 1000000000ll +
+                     cpu_end.tv_nsec - cpu_start.tv_nsec;
+    TEST_CHECK_(cpu_ns < 50000000, "%lld ns of cpu", (long long)cpu_ns);
+    TEST_CHECK(stream_set_lowat(server, 0, 0) == 0);
+    TEST_CHECK(stream_wait(server, STREAM_READABLE, 0) == STREAM_READABLE);
+    TEST_CHECK(stream_read(buffered, buffer, sizeof(buffer)) == 1);
+    stream_close(buffered);
+
+    /* Once the client hangs up, the server side is finished */
+    stream_close(client);
+    int e = 1;
+    for (int i = 0; i < 100; i++) {
+        e = stream_available(server, &read, NULL);
+        if (e != 1)
+            break;
+        usleep(1000);
+    }
+    TEST_CHECK(e == 0);
+    stream_close(server);
+    stream_close(listener);
+}
+
+void test_poll(void)
+{
+    char buffer[16];
+    pthread_t thread;
+    short revents[3];
+
+    struct stream *listener = stream_tcp_listen("localhost", 13373, 4, 0);
+    struct stream *client = stream_tcp_open("localhost", 13373);
+    struct stream *server = stream_tcp_accept(listener);
+    struct stream *pipe = stream_pipe_spsc_open(16);
+    struct stream *line = stream_line_open(server);
+    TEST_CHECK(listener && client && server && pipe && line);
+
+    struct stream *streams[] = {pipe, line, client};
+    short events[] = {STREAM_READABLE, STREAM_READABLE, STREAM_READABLE};
+
+    TEST_CHECK(stream_poll(streams, 3, events, revents, 10 * 1000 * 1000) ==
+               0);
+
+    /* In-memory stream, woken from another thread */
+    TEST_CHECK(pthread_create(&thread, NULL, delayed_write_thread, pipe) ==
+               0);
+    TEST_CHECK(stream_poll(streams, 3, events, revents, -1) == 1);
+    TEST_CHECK(revents[0] == STREAM_READABLE);
+    TEST_CHECK(revents[1] == 0 && revents[2] == 0);
+    pthread_join(thread, NULL);
+    TEST_CHECK(stream_read(pipe, buffer, sizeof(buffer)) == 3);
+
+    /* Descriptor stream, underneath a line stream */
+    TEST_CHECK(stream_write(client, "bar\n", 4) == 4);
+    TEST_CHECK(stream_poll(streams, 3, events, revents, -1) == 1);
+    TEST_CHECK(revents[1] == STREAM_READABLE);
+    TEST_CHECK(stream_read(line, buffer, sizeof(buffer)) == 3);
+
+    /* Only one stream_poll may watch a stream, and a refused one leaves
+     * the stream free for the next */
+    struct stream *twice[] = {pipe, pipe};
+    TEST_CHECK(stream_poll(twice, 2, events, revents, 0) == -EBUSY);
+    TEST_CHECK(stream_poll(streams, 3, events, revents, 0) == 0);
+
+    stream_close(line);
+    stream_close(pipe);
+    stream_close(server);
+    stream_close(client);
+    stream_close(listener);
+}
+
+void test_unix(void)
+{
+    const char *path = "/tmp/test_unix.sock";
+    char buffer[16];
+    int fds[2], received[2], nfds = 2;
+
+    unlink(path);
+    struct stream *listener = stream_unix_listen(path, 4, 0);
+    TEST_CHECK(listener != NULL);
+    struct stream *client = stream_unix_open(path);
+    struct stream *server = stream_unix_accept(listener);
+    TEST_CHECK(client != NULL && server != NULL);
+
+    TEST_CHECK(stream_write(client, "ping", 4) == 4);
+    TEST_CHECK(stream_read(server, buffer, sizeof(buffer)) == 4);
+    TEST_CHECK(memcmp(buffer, "ping", 4) == 0);
+
+    /* Pass one end of a pipe across, and talk through it */
+    TEST_CHECK(pipe(fds) == 0);
+    TEST_CHECK(stream_unix_send_fds(client, "f", 1, &fds[1], 1) == 1);
+    TEST_CHECK(stream_unix_recv_fds(server, buffer, sizeof(buffer), received,
+                                    &nfds) == 1);
+    TEST_CHECK(nfds == 1 && received[0] != fds[1]);
+    TEST_CHECK(write(received[0], "pipe", 4) == 4);
+    TEST_CHECK(read(fds[0], buffer, sizeof(buffer)) == 4);
+    TEST_CHECK(memcmp(buffer, "pipe", 4) == 0);
+    close(received[0]);
+    close(fds[0]);
+    close(fds[1]);
+
+    stream_close(client);
+    stream_close(server);
+    stream_close(listener);
+    TEST_CHECK(access(path, F_OK) < 0);
+
+    /* Packet boundaries are kept with SOCK_SEQPACKET */
+    listener = stream_unix_listen(path, 4, STREAM_UNIX_SEQPACKET);
+    client = stream_unix_open_ex(path, STREAM_UNIX_SEQPACKET);
+    server = stream_unix_accept(listener);
+    TEST_CHECK(listener && client && server);
+    TEST_CHECK(stream_write(client, "one", 3) == 3);
+    TEST_CHECK(stream_write(client, "two", 3) == 3);
+    TEST_CHECK(stream_read(server, buffer, sizeof(buffer)) == 3);
+    TEST_CHECK(stream_read(server, buffer, sizeof(buffer)) == 3);
+    TEST_CHECK(memcmp(buffer, "two", 3) == 0);
+    /* A packet that does not fit is reported, not silently cut short */
+    TEST_CHECK(stream_write(client, "12345678", 8) == 8);
+    TEST_CHECK(stream_read(server, buffer, 4) == -EMSGSIZE);
+    stream_close(client);
+    stream_close(server);
+    stream_close(listener);
+
+    /* Descriptor passing needs a unix socket, not just any socket */
+    listener = stream_tcp_listen("localhost", 13375, 4, 0);
+    client = stream_tcp_open("localhost", 13375);
+    TEST_CHECK(listener && client);
+    TEST_CHECK(stream_unix_send_fds(client, "x", 1, fds, 1) == -EINVAL);
+    stream_close(client);
+    stream_close(listener);
+}
+
 TEST_LIST = {{"mem", test_mem},
              {"file", test_file},
+             {"copy_file", test_copy_file},
+             {"file_uring", test_file_uring},
+             {"file_mmap", test_file_mmap},
              {"condition", test_condition},
+             {"notify_ex", test_notify_ex},
+             {"lowat", test_lowat},
+             {"wait", test_wait},
+             {"pipe_wrap", test_pipe_wrap},
+             {"shm", test_shm},
+             {"pipe_spsc", test_pipe_spsc},
+             {"buffered", test_buffered},
              {"line", test_line_reader},
+             {"line_lengths", test_line_lengths},
+             {"line_next", test_line_next},
+             {"storage", test_storage},
+             {"peek", test_peek},
+             {"rand", test_rand},
+             {"stats", test_stats},
+             {"vectored", test_vectored},
+             {"large", test_large},
              {"process", test_process},
              {"process_interactive", test_process_interactive},
+             {"nonblocking", test_nonblocking},
+             {"loop", test_loop},
              {"tcp", test_tcp},
+             {"tcp_uring", test_tcp_uring},
+             {"tcp_listen", test_tcp_listen},
+             {"poll", test_poll},
+             {"unix", test_unix},
              {NULL, NULL}};
\ No newline at end of file